@@ -1,6 +1,7 @@
 #ifndef FIBER_H
 #define FIBER_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint fiber_t;
@@ -21,8 +22,28 @@ typedef enum {
 
 typedef enum {
     RR = 0, /**< round-robin */
+    EDF,    /**< earliest deadline first, ahead of all RR threads */
 } fiber_sched_policy;
 
+/* lowest RR priority, 0 is the highest one */
+#define FIBER_PRIO_LOWEST 15
+
+typedef struct {
+    int policy;             /**< fiber_sched_policy */
+    unsigned long deadline; /**< EDF only: relative deadline in us */
+    size_t stacksize;       /**< stack size in bytes, 0 for the default */
+    int sharedstack;        /**< run on the shared stack of a worker */
+    int priority;           /**< 0 to FIBER_PRIO_LOWEST */
+} fiber_attr_t;
+
+typedef enum {
+    FIBER_CANCEL_DEFERRED = 0, /**< act on cancellation at park points */
+    FIBER_CANCEL_ASYNCHRONOUS, /**< also act on it when preempted */
+} fiber_cancel_type;
+
+/* fiber_join() result of a thread which was canceled or missed its deadline */
+#define FIBER_CANCELED 1
+
 /* user_level thread control block (TCB) */
 typedef struct _tcb_internal _tcb;
 
@@ -30,6 +51,7 @@ typedef struct {
     _tcb *owner;
     uint lock;
     list_node wait_list;
+    list_node held; /* node in the list of mutexes the owner holds */
 } fiber_mutex_t;
 
 typedef struct {
@@ -37,6 +59,14 @@ typedef struct {
     fiber_mutex_t list_mutex;
 } fiber_cond_t;
 
+typedef struct {
+    int pending;         /* unfinished tasks, plus one until waited for */
+    int error;           /* result of the first task which failed */
+    int canceled;        /* queued tasks are dropped instead of run */
+    uint done;           /* set once the last task has finished */
+    list_node wait_list; /* user-level threads waiting for the group */
+} fiber_group_t;
+
 /**
  * @brief Initialize Fiber internal data structure.
  *
@@ -44,28 +74,271 @@ typedef struct {
  *            beteen user-level thread and kernel-level implementation.
  */
 int fiber_init(int num);
+
+/**
+ * @brief Shut down Fiber and release its resources.
+ * Waits until no user-level thread is runnable anymore, then cancels the
+ * threads which are still blocked, joins the native threads and frees all
+ * pools. The canceled threads are woken up to unwind. A thread which never
+ * stops running keeps fiber_destroy() waiting, see fiber_destroy_timeout().
+ * Memory obtained from fiber_alloc() inside the workers must be released
+ * before. fiber_init() may be called again afterwards.
+ */
 void fiber_destroy(void);
 
+/**
+ * @brief Shut down Fiber like fiber_destroy(), waiting @p usec microseconds
+ * at most for runnable threads.
+ * Threads still runnable by then are canceled as well and unwind at their
+ * next park point. One which runs without ever reaching a park point still
+ * holds up the shutdown, unless its cancellation type is
+ * FIBER_CANCEL_ASYNCHRONOUS.
+ */
+void fiber_destroy_timeout(unsigned long usec);
+
 /**
  * @brief Create a new thread.
  */
 int fiber_create(fiber_t *tid, void (*start_func)(void *), void *arg);
 
+/**
+ * @brief Initialize thread attributes to the defaults of fiber_create().
+ */
+int fiber_attr_init(fiber_attr_t *attr);
+
+/**
+ * @brief Set the scheduling policy, RR or EDF.
+ */
+int fiber_attr_setschedpolicy(fiber_attr_t *attr, int policy);
+
+/**
+ * @brief Set the relative deadline of an EDF thread, in microseconds.
+ * Runnable EDF threads run in order of creation time plus this deadline and
+ * preempt RR threads. Missing the deadline does not cancel the thread, see
+ * fiber_set_deadline() for that.
+ */
+int fiber_attr_setdeadline(fiber_attr_t *attr, unsigned long usec);
+
+/**
+ * @brief Set the stack size, at least 8 KiB, or 0 for the default of 32 KiB.
+ */
+int fiber_attr_setstacksize(fiber_attr_t *attr, size_t size);
+
+/**
+ * @brief Set the priority, from 0, the highest and default, to
+ * FIBER_PRIO_LOWEST.
+ * Runnable threads of a higher priority run first. EDF threads count as the
+ * highest priority when they block others on a mutex.
+ */
+int fiber_attr_setpriority(fiber_attr_t *attr, int prio);
+
+/**
+ * @brief Run the thread on the shared stack of a worker if @p shared is set.
+ * The thread gets no stack of its own. The used part of the shared stack is
+ * copied out when another such thread runs on the worker, and back in before
+ * the thread resumes, which binds the thread to the worker it was created
+ * on (or one picked by ID when created outside of the workers). Pointers to
+ * its stack must not be handed to other threads.
+ */
+int fiber_attr_setsharedstack(fiber_attr_t *attr, int shared);
+
+/**
+ * @brief Create a new thread with the given attributes, NULL for defaults.
+ */
+int fiber_create_attr(fiber_t *tid,
+                      const fiber_attr_t *attr,
+                      void (*start_func)(void *),
+                      void *arg);
+
+/**
+ * @brief Enable or disable stack statistics for threads created from now on.
+ * Their stacks are painted with a canary, and the high-water mark of each one
+ * is reported on stderr when it terminates. fiber_destroy() reports the peak
+ * per entry function and turns statistics off again.
+ */
+int fiber_stack_stats(int enable);
+
+/**
+ * @brief Set the stack size of new threads starting at @p start_func.
+ * Applies when no stack size is given through fiber_attr_t, until
+ * fiber_destroy(). A size of 0 restores the default.
+ */
+int fiber_stack_hint(void (*start_func)(void *), size_t size);
+
+/**
+ * @brief Deepest stack usage measured so far for threads of @p start_func.
+ */
+size_t fiber_stack_peak(void (*start_func)(void *));
+
 /**
  * @brief Yield the processor to other user level threads voluntarily.
  */
 int fiber_yield();
 
+/**
+ * @brief Change the priority of the calling thread.
+ * Its effective priority stays raised while it holds a mutex which threads
+ * of a higher priority wait for.
+ */
+int fiber_setpriority(int prio);
+
+/**
+ * @brief Bind a thread to a worker, or release it again with -1.
+ * Takes effect the next time the thread becomes runnable, so a thread moves
+ * itself by pinning and then yielding. Shared-stack threads cannot be moved.
+ */
+int fiber_pin(fiber_t thread, int worker);
+
+/**
+ * @brief Let the wakeups of a thread prefer a worker, -1 removes the hint.
+ * A woken thread normally runs next on the worker of its waker, or on the one
+ * it ran on last when woken from outside of the workers. Unlike fiber_pin(),
+ * other workers still take it over when that worker stays busy.
+ */
+int fiber_hint(fiber_t thread, int worker);
+
+/**
+ * @brief Number of the worker running the caller, -1 outside of the workers.
+ */
+int fiber_worker(void);
+
+/**
+ * @brief Store the ID of the calling thread in @p tid.
+ * Fails outside of user-level threads.
+ */
+int fiber_self(fiber_t *tid);
+
+/**
+ * @brief Block the calling thread until it holds a wake token, and take it.
+ * Returns at once if fiber_unpark() left a token before. A thread has at most
+ * one token, so check the condition waited for again after returning. Only
+ * user-level threads park; they switch out instead of blocking their worker.
+ */
+int fiber_park(void);
+
+/**
+ * @brief Give @p thread a wake token, waking it up if it is parked.
+ * May be called from user-level threads and from native threads alike.
+ */
+int fiber_unpark(fiber_t thread);
+
 /**
  * @brief Wait for thread termination.
+ * A calling fiber parks, other callers block their native thread.
+ * Returns FIBER_CANCELED if the thread was canceled.
  */
 int fiber_join(fiber_t thread, void **value_ptr);
 
 /**
  * @brief Terminate a thread.
+ * Pending cleanup handlers are run first.
  */
 void fiber_exit(void *retval);
 
+/**
+ * @brief Request the cancellation of a thread.
+ * The thread acts on it at its next park point (mutex, condition variable,
+ * yield, fiber_park, fiber_testcancel) or before it starts to run. A blocked
+ * thread is woken up to do so. The thread then runs its cleanup handlers,
+ * terminates and its TCB is recycled.
+ */
+int fiber_cancel(fiber_t thread);
+
+/**
+ * @brief Cancel a thread once @p usec microseconds have elapsed from now.
+ * A value of 0 removes the deadline.
+ */
+int fiber_set_deadline(fiber_t thread, unsigned long usec);
+
+/**
+ * @brief Set the cancellation type of the calling thread.
+ * With FIBER_CANCEL_ASYNCHRONOUS, cancellation also takes effect when the
+ * thread is preempted, so it must not be in the middle of non-reentrant code
+ * such as malloc() at that time.
+ */
+int fiber_setcanceltype(int type, int *oldtype);
+
+/**
+ * @brief Act on a pending cancellation of the calling thread, if any.
+ */
+void fiber_testcancel(void);
+
+/**
+ * @brief Push a handler to run if the calling thread is canceled or exits.
+ */
+int fiber_cleanup_push(void (*routine)(void *), void *arg);
+
+/**
+ * @brief Pop the latest cleanup handler and run it if @p execute is non-zero.
+ */
+void fiber_cleanup_pop(int execute);
+
+/**
+ * @brief Allocate memory from the per-worker pools.
+ * Memory may outlive the calling thread and be released from any thread.
+ */
+void *fiber_alloc(size_t size);
+
+/**
+ * @brief Release memory obtained from fiber_alloc().
+ */
+void fiber_free(void *ptr);
+
+/**
+ * @brief Allocate memory from the arena of the calling user-level thread.
+ * The arena is released as a whole when the thread terminates, so there is
+ * no need to free the memory individually. Returns NULL outside of a fiber.
+ */
+void *fiber_arena_alloc(size_t size);
+
+/**
+ * @brief Initialize a group of tasks.
+ * Tasks are stackless jobs run to completion on the stack of whichever
+ * thread picks them up: a worker, with 8 MiB of stack, or a fiber waiting in
+ * fiber_group_wait(), with the stack size of that fiber. Give fibers which
+ * wait for tasks with large frames a stack to match. Tasks run by a worker
+ * are not preempted; those run by a waiting fiber are preempted along with
+ * it and may resume on another worker. Tasks must not block on anything but
+ * fiber_group_wait() of a group they spawned themselves.
+ */
+int fiber_group_init(fiber_group_t *group);
+
+/**
+ * @brief Queue @p func as a task of @p group and return right away.
+ * The caller keeps running while idle workers steal the task. A non-zero
+ * result of @p func cancels the tasks of the group which have not started.
+ */
+int fiber_group_spawn(fiber_group_t *group, int (*func)(void *), void *arg);
+
+/**
+ * @brief Wait for all tasks of the group, running queued ones meanwhile.
+ * Returns the result of the first task which failed, 0 if none did. The
+ * group may be reused afterwards.
+ */
+int fiber_group_wait(fiber_group_t *group);
+
+/**
+ * @brief Drop the tasks of the group which have not started yet.
+ */
+void fiber_group_cancel(fiber_group_t *group);
+
+/**
+ * @brief Whether the group was canceled, for long tasks to bail out early.
+ */
+int fiber_group_canceled(fiber_group_t *group);
+
+/**
+ * @brief Run @p body over [@p begin, @p end) in chunks of @p grain indices.
+ * The chunks are tasks of a private group, waited for before returning. A
+ * @p grain of 0 picks a few chunks per worker. Returns the result of the
+ * first chunk which failed, 0 if none did.
+ */
+int fiber_parallel_for(size_t begin,
+                       size_t end,
+                       size_t grain,
+                       int (*body)(size_t, size_t, void *),
+                       void *arg);
+
 /**
  * @brief Initialize the mutex lock.
  */
@@ -73,6 +346,10 @@ int fiber_mutex_init(fiber_mutex_t *mutex);
 
 /**
  * @brief Acquire the mutex lock.
+ * While blocked, the thread lends its priority to the owner, and along the
+ * chain of mutexes the owner itself waits for. Owners get their priority back
+ * when they release the mutex. A released mutex goes to its first waiter of
+ * the highest priority.
  */
 int fiber_mutex_lock(fiber_mutex_t *mutex);
 
@@ -83,6 +360,7 @@ int fiber_mutex_unlock(fiber_mutex_t *mutex);
 
 /**
  * @brief Destory the mutex lock.
+ * Fails if the mutex is still held or waited for.
  */
 int fiber_mutex_destroy(fiber_mutex_t *mutex);
 
@@ -97,18 +375,22 @@ int fiber_cond_init(fiber_cond_t *condvar);
 int fiber_cond_broadcast(fiber_cond_t *condvar);
 
 /**
- * @brief Wake up a thread on waiting list.
+ * @brief Wake up a thread on waiting list, the first one of the highest
+ * priority.
  */
 int fiber_cond_signal(fiber_cond_t *condvar);
 
 /**
  * @brief Wait on a condition.
  * Current thread would go to sleep until other thread wakes it up.
+ * If the thread is canceled meanwhile, the mutex is acquired again before
+ * the cleanup handlers run.
  */
 int fiber_cond_wait(fiber_cond_t *condvar, fiber_mutex_t *mutex);
 
 /**
  * @brief Destory condition variable.
+ * Fails if some thread is still waiting on it.
  */
 int fiber_cond_destroy(fiber_cond_t *condvar);
 
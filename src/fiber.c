@@ -2,53 +2,224 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <sched.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
-#include <sys/time.h>
+#include <time.h>
 #include <ucontext.h>
 #include <unistd.h>
 
 #include "fiber.h"
 
 #define _THREAD_STACK 1024 * 32
-#define U_THREAD_MAX 16
+#define K_THREAD_STACK (1024 * 1024 * 8) /* per worker, tasks run on it */
+#define U_THREAD_MAX (1024 * 4096) /* thread IDs, slots mapped on demand */
 #define K_THREAD_MAX 4
-#define K_CONTEXT_MASK 0b11 /* bitmask for native thread ID */
-#define PRIORITY 16
-#define TIME_SLICE 50000 /* in us */
+#define PRIORITY (FIBER_PRIO_LOWEST + 1)
+#define TIME_SLICE 50000          /* in us */
+#define SPIN_TRIES 64             /* before a spinning worker yields its CPU */
+#define SHARED_STACK (1024 * 256) /* per worker, for shared-stack threads */
+#define SHARED_STACK_SLACK 128    /* below the frame of k_thread_switch() */
+#define RUNNEXT_MAX 16            /* handoffs in a row before the run queues */
+#define RUNNEXT_GRACE 50000 /* in ns, before idle workers take a handoff */
+
+/* fiber-aware allocator: size classes from 16 B up to 2 KiB */
+#define ALLOC_ALIGN 16
+#define ALLOC_MIN_SHIFT 4
+#define ALLOC_CLASSES 8
+#define ALLOC_SLAB_SIZE (64 * 1024) /* slab carved into a single class */
+#define ALLOC_HEAP 0xFFFF           /* owner of blocks backed by malloc */
+#define ARENA_CHUNK (1 << (ALLOC_MIN_SHIFT + ALLOC_CLASSES - 1))
+#define TCB_CACHE_MAX 8 /* recycled TCBs kept per worker */
+
+/* stack usage accounting */
+#define STACK_MIN (1024 * 8) /* room for the signal frame of schedule() */
+#define STACK_SITES 64       /* entry functions tracked */
+#define STACK_CANARY 0xDEADBEEFCAFEF00DULL
 
 /* user-level thread control block (TCB) */
 struct _tcb_internal {
-    fiber_t tid;         /* thread ID            */
-    fiber_status status; /* thread status        */
-    ucontext_t context;  /* thread contex        */
-    uint prio;           /* thread priority      */
-    list_node node;      /* thread node in queue */
-    char stack[1];       /* thread stack pointer */
+    fiber_t tid;           /* thread ID            */
+    fiber_status status;   /* thread status        */
+    ucontext_t context;    /* thread contex        */
+    uint prio;             /* effective priority   */
+    int policy;            /* RR or EDF            */
+    uint64_t edf_due;      /* EDF deadline, in ns  */
+    list_node node;        /* thread node in queue */
+    list_node link;        /* node in all_threads  */
+    struct _arena *arena;  /* per-fiber bump arena */
+    size_t stack_size;     /* size of stack[]      */
+    void (*entry)(void *); /* entry function      */
+
+    /* cancellation */
+    bool canceled;            /* cancellation is pending          */
+    int cancel_type;          /* deferred or asynchronous         */
+    uint64_t deadline;        /* CLOCK_MONOTONIC in ns, 0 if none */
+    list_node *wait_list;     /* wait list blocked on, if any     */
+    struct _cleanup *cleanup; /* cleanup handlers, latest first   */
+
+    /* shared stack */
+    int k_bound;                /* worker it is bound to, -1 if none */
+    bool shared;                /* runs on the stack of k_bound      */
+    char *stack_sp;             /* lowest byte used when switched out */
+    char *saved;                /* used part of the stack, saved     */
+    size_t saved_size;          /* capacity of saved                 */
+    void (*start_func)(void *); /* context is made on the first run  */
+    void *start_arg;
+
+    /* placement */
+    int k_last; /* worker it ran on last, -1 if none   */
+    int k_hint; /* worker its wakeups prefer, -1 if none */
+
+    /* priority inheritance */
+    uint base_prio;            /* priority of its own, not inherited */
+    list_node held;            /* mutexes it holds                   */
+    fiber_mutex_t *waiting_on; /* mutex it blocks on, if any         */
+
+    char stack[1]; /* thread stack pointer */
 };
 
 #define GET_TCB(ptr) \
     ((_tcb *) ((char *) (ptr) - (unsigned long long) (&((_tcb *) 0)->node)))
+#define GET_TCB_LINK(ptr) \
+    ((_tcb *) ((char *) (ptr) - (unsigned long long) (&((_tcb *) 0)->link)))
+#define GET_MUTEX(ptr)                   \
+    ((fiber_mutex_t *) ((char *) (ptr) - \
+                        (unsigned long long) (&((fiber_mutex_t *) 0)->held)))
+
+/* stackless task of a group, queued on the deque of a worker */
+typedef struct {
+    list_node node;                      /* node in a task deque */
+    fiber_group_t *group;                /* group it belongs to  */
+    int (*func)(void *);                 /* fiber_group_spawn()  */
+    int (*body)(size_t, size_t, void *); /* fiber_parallel_for() */
+    size_t lo, hi;                       /* range of the chunk   */
+    void *arg;                           /* argument of either   */
+} _task;
+
+#define GET_TASK(ptr) \
+    ((_task *) ((char *) (ptr) - (unsigned long long) (&((_task *) 0)->node)))
 
 /* user-level thread queue */
 static list_node thread_queue[PRIORITY];
 
+/* per-worker EDF run queue: a binary min-heap on the absolute deadline,
+ * nested inside _spinlock when pushing
+ */
+typedef struct {
+    _tcb **thread;
+    int size;
+    int capacity; /* room for all EDF threads, reserved on creation */
+    uint64_t top; /* deadline of thread[0], UINT64_MAX if empty */
+    int top_k;    /* worker thread[0] is bound to, -1 if none */
+    uint lock;
+} edf_heap;
+
+static edf_heap edf_queue[K_THREAD_MAX];
+static int edf_threads = 0; /* EDF threads which are alive */
+
+/* run queue of the threads bound to each worker, guarded by _spinlock */
+static list_node k_thread_queue[K_THREAD_MAX];
+
+/* take the bound run queue first on every other turn, for fairness */
+static bool k_thread_turn[K_THREAD_MAX];
+
+/* "run next" slot of each worker: a thread woken up there runs as soon as its
+ * waker switches out, guarded by _spinlock
+ */
+static _tcb *k_thread_next[K_THREAD_MAX];
+static uint64_t k_thread_next_since[K_THREAD_MAX]; /* when it was filled */
+static int k_thread_handoffs[K_THREAD_MAX]; /* taken from the slot in a row */
+
+/* shared stack of each worker, and the thread whose frames it holds */
+static char *k_shared_stack[K_THREAD_MAX];
+static _tcb *k_shared_owner[K_THREAD_MAX];
+
+/* every user-level thread which has not been reclaimed yet */
+static list_node all_threads;
+
 /* current user-level thread context */
 static list_node *cur_thread_node[K_THREAD_MAX];
 
 /* native thread context */
 static ucontext_t context_main[K_THREAD_MAX];
 
+/* per-worker task deques: the owner takes the newest task, thieves the
+ * oldest one
+ */
+static list_node task_deque[K_THREAD_MAX];
+static uint task_lock[K_THREAD_MAX];
+
+/* worker receiving the next task spawned outside of the workers */
+static uint task_next = 0;
+
+/* native thread of each worker, indexed by worker number */
+static pthread_t k_thread[K_THREAD_MAX];
+
+/* timer preempting the user-level thread a worker runs */
+static timer_t k_thread_timer[K_THREAD_MAX];
+
+/* timer of each worker kicking an idle one to take over a handoff which it
+ * has not picked up within RUNNEXT_GRACE, and whether it is set; left set
+ * while the worker has no timer
+ */
+static timer_t k_thread_kick_timer[K_THREAD_MAX];
+static bool k_thread_kick_armed[K_THREAD_MAX];
+
+/* what a worker does with the user-level thread which just switched out */
+typedef enum {
+    K_ACTION_NONE = 0, /* blocked, someone else makes it runnable again */
+    K_ACTION_READY,    /* put it back to the run queue */
+    K_ACTION_RECLAIM,  /* terminated, release its resources */
+    K_ACTION_UNLOCK,   /* blocked, release _spinlock held while blocking */
+} k_action;
+
+static k_action k_thread_action[K_THREAD_MAX];
+
+/* idle workers sleep on k_thread_idle_seq until new work arrives */
+static uint k_thread_idle_seq = 0;
+static int k_thread_idle = 0;
+static bool k_thread_shutdown = false;
+
+/* EDF deadline of the thread each worker runs, UINT64_MAX for an RR thread
+ * and 0 while running none
+ */
+static uint64_t k_thread_due[K_THREAD_MAX];
+
+/* number of workers handling a user-level thread they just dequeued */
+static int k_thread_busy = 0;
+
+/* remaining threads get canceled once, when the runtime has drained or
+ * k_thread_drain_due, set by fiber_destroy_timeout(), has passed
+ */
+static bool k_thread_cancel_all = false;
+static uint64_t k_thread_drain_due = UINT64_MAX;
+
+/* earliest deadline of all user-level threads, UINT64_MAX if none */
+static uint64_t next_deadline = UINT64_MAX;
+
 /* number of active threads */
 static int user_thread_num = 0;
 
-static __thread int preempt_disable_count = 0;
+/* Worker-local state, one copy per native thread. A user-level thread may
+ * resume on another worker after any switch, so it is only reached through
+ * the out-of-line accessors below, which address it relative to the thread
+ * pointer at the time of each access.
+ */
+#define K_THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+static K_THREAD_LOCAL int k_thread_id = -1;
+static K_THREAD_LOCAL int preempt_disable_count = 0;
 
 /* global spinlock for critical section _queue */
 static uint _spinlock = 0;
@@ -56,248 +227,2252 @@ static uint _spinlock = 0;
 typedef struct {
     sem_t semaphore;
     unsigned long *val;
+    _tcb *thread;      /* TCB while the thread is alive */
+    bool used;         /* thread ID is taken until fiber_join() */
+    bool canceled;     /* the thread was canceled */
+    bool exited;       /* the thread was reclaimed */
+    list_node joiners; /* user-level threads blocked in fiber_join() */
+    uint park;         /* wake token of fiber_park(), a park_state */
+    list_node parked;  /* the thread itself while in fiber_park() */
+    fiber_t next_free; /* next released thread ID, while not used */
 } sig_sem;
 
-/* global semaphore for user-level thread */
-static sig_sem sigsem_thread[U_THREAD_MAX];
+/* wake token of a thread; PARKED only while it is switched out in
+ * fiber_park(), set and cleared with _spinlock held
+ */
+typedef enum { PARK_EMPTY, PARK_TOKEN, PARK_PARKED } park_state;
+
+/* slots of the thread IDs, in chunks which are mapped on demand and never
+ * move, so that a slot is found without a lock
+ */
+#define SIGSEM_CHUNK 1024
+static sig_sem *sigsem_chunk[U_THREAD_MAX / SIGSEM_CHUNK];
+static fiber_t sigsem_next = 0;            /* lowest ID never handed out */
+static fiber_t sigsem_free = U_THREAD_MAX; /* released IDs, LIFO */
 
 /* timer management */
-static struct itimerval timeslice;
-static struct itimerval zero_timer = {0};
+static struct itimerspec timeslice;
 
 #ifndef unlikely
 #define unlikely(x) __builtin_expect((x), 0)
 #endif
 
-/* diable schedule of native thread */
-static inline void preempt_disable()
+/* The counter is thread-local, and a fiber may be preempted and resume on
+ * another worker between computing its address and updating it, which would
+ * leave the old worker unpreemptible for good. The update must therefore be a
+ * single instruction addressing the TLS block of whichever worker executes it.
+ */
+#if !defined(__x86_64__)
+#error "preempt_disable() needs a single-instruction TLS update for this CPU"
+#endif
+
+/* diable schedule of native thread; only schedule() on the same native
+ * thread reads the counter, so a single instruction is atomic enough
+ */
+static __attribute__((noinline)) void preempt_disable()
+{
+    __asm__ __volatile__("addl $1, %0" : "+m"(preempt_disable_count)::"memory");
+}
+
+static __attribute__((noinline)) void preempt_enable()
+{
+    __asm__ __volatile__("subl $1, %0" : "+m"(preempt_disable_count)::"memory");
+}
+
+/* whether the calling native thread runs with preemption disabled */
+static __attribute__((noinline)) bool preempt_disabled()
+{
+    return __atomic_load_n(&preempt_disable_count, __ATOMIC_RELAXED) > 0;
+}
+
+static inline void spin_lock(uint *lock)
+{
+    preempt_disable();
+
+    /* the holder may be a worker which the kernel switched out */
+    for (int i = 0; __atomic_test_and_set(lock, __ATOMIC_ACQUIRE); i++) {
+        if (i >= SPIN_TRIES)
+            sched_yield();
+    }
+}
+
+static inline void spin_unlock(uint *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+/* slot of a thread ID, NULL if no ID of its chunk was handed out yet */
+static inline sig_sem *sigsem_of(fiber_t id)
+{
+    if (id >= U_THREAD_MAX)
+        return NULL;
+    sig_sem *chunk =
+        __atomic_load_n(&sigsem_chunk[id / SIGSEM_CHUNK], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[id % SIGSEM_CHUNK] : NULL;
+}
+
+/* take the latest released thread ID, or the lowest one never handed out,
+ * mapping the chunk of its slot outside of _spinlock; U_THREAD_MAX if none
+ * is left. Out of line, as the caller goes on to getcontext().
+ */
+static __attribute__((noinline)) fiber_t sigsem_take()
+{
+    while (1) {
+        fiber_t id = U_THREAD_MAX;
+
+        spin_lock(&_spinlock);
+        if (sigsem_free != U_THREAD_MAX) {
+            id = sigsem_free;
+            sigsem_free = sigsem_of(id)->next_free;
+        } else if (sigsem_next < U_THREAD_MAX &&
+                   sigsem_chunk[sigsem_next / SIGSEM_CHUNK])
+            id = sigsem_next++;
+        if (id != U_THREAD_MAX)
+            sigsem_of(id)->used = true;
+        fiber_t next = sigsem_next;
+        spin_unlock(&_spinlock);
+
+        if (id != U_THREAD_MAX || next == U_THREAD_MAX)
+            return id;
+
+        /* pages of the slots only become resident once touched */
+        sig_sem *chunk =
+            mmap(NULL, SIGSEM_CHUNK * sizeof(sig_sem), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == chunk)
+            return U_THREAD_MAX;
+        sig_sem *expected = NULL;
+        if (!__atomic_compare_exchange_n(&sigsem_chunk[next / SIGSEM_CHUNK],
+                                         &expected, chunk, false,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            munmap(chunk, SIGSEM_CHUNK * sizeof(sig_sem));
+    }
+}
+
+/* hand a thread ID out again, after its slot has been cleaned up */
+static void sigsem_release(fiber_t id)
+{
+    sig_sem *sem = sigsem_of(id);
+
+    spin_lock(&_spinlock);
+    __atomic_store_n(&sem->used, false, __ATOMIC_RELEASE);
+    sem->next_free = sigsem_free;
+    sigsem_free = id;
+    spin_unlock(&_spinlock);
+}
+
+static inline bool is_queue_empty(list_node *q)
+{
+    return (bool) (q->prev == q) && (q->next == q);
+}
+
+static inline void enqueue(list_node *q, list_node *node)
+{
+    node->next = q;
+    q->prev->next = node;
+    node->prev = q->prev;
+    q->prev = node;
+}
+
+static inline bool dequeue(list_node *q, list_node **node)
+{
+    if (is_queue_empty(q))
+        return false;
+
+    *node = q->next;
+    q->next = q->next->next;
+    q->next->prev = q;
+
+    (*node)->next = (*node)->prev = NULL;
+    return true;
+}
+
+static inline void list_remove(list_node *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+}
+
+static inline long futex(uint *uaddr,
+                         int op,
+                         uint val,
+                         const struct timespec *timeout)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Fiber internals */
+
+/* FIXME: avoid the use of global variables */
+static int thread_nums = 0;
+
+/* worker number of the calling native thread, -1 for non-workers */
+static __attribute__((noinline)) int k_thread_self()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return k_thread_id;
+}
+
+/* TCB of the user-level thread calling this, NULL outside of the workers
+ * and in tasks, which run on the stack of the worker itself
+ */
+static inline _tcb *current_tcb()
+{
+    _tcb *cur_tcb = NULL;
+
+    /* do not migrate between looking up the worker and its current thread */
+    preempt_disable();
+    int k = k_thread_self();
+    if (k >= 0 && cur_thread_node[k])
+        cur_tcb = GET_TCB(cur_thread_node[k]);
+    preempt_enable();
+    return cur_tcb;
+}
+
+/* Fiber-aware memory allocator
+ *
+ * Small blocks come from per-worker size-class free lists. Only the owning
+ * worker touches its local lists, with preemption disabled, so the fast path
+ * takes no lock. Blocks released by any other thread are pushed onto the
+ * owner's lock-free remote list, which the owner takes back as a whole batch
+ * once its local list runs dry. Oversized blocks, and blocks allocated from
+ * outside the workers, fall back to malloc.
+ */
+
+typedef struct {
+    uint owner; /* worker number, or ALLOC_HEAP */
+    uint cls;   /* size class                   */
+} __attribute__((aligned(ALLOC_ALIGN))) blk_hdr;
+
+typedef struct free_blk {
+    struct free_blk *next;
+} free_blk;
+
+typedef struct {
+    free_blk *local[ALLOC_CLASSES];  /* accessed by the owner only       */
+    free_blk *remote[ALLOC_CLASSES]; /* freed by other threads           */
+    void *slabs;                     /* slabs carved so far, chained     */
+    list_node *tcb_cache;            /* recycled TCBs, chained via node  */
+    int tcb_cached;                  /* number of TCBs in tcb_cache      */
+} k_heap;
+
+static k_heap k_heaps[K_THREAD_MAX];
+
+/* recycled TCBs overflowing the per-worker caches */
+static list_node *tcb_depot = NULL;
+static uint tcb_depot_lock = 0;
+
+/* per-fiber bump arena chunk, released as a whole when the fiber exits */
+struct _arena {
+    struct _arena *next;
+    size_t size; /* usable bytes following the header */
+    size_t used;
+} __attribute__((aligned(ALLOC_ALIGN)));
+
+/* cleanup handler pushed by fiber_cleanup_push() */
+struct _cleanup {
+    void (*routine)(void *);
+    void *arg;
+    struct _cleanup *next;
+};
+
+static inline uint alloc_class(size_t size)
+{
+    if (size <= (1 << ALLOC_MIN_SHIFT))
+        return 0;
+    return sizeof(long) * 8 - __builtin_clzl(size - 1) - ALLOC_MIN_SHIFT;
+}
+
+/* refill an empty local free list of the calling worker */
+static free_blk *alloc_refill(k_heap *heap, uint k, uint cls)
+{
+    /* take back every block other threads have freed in one go */
+    free_blk *list =
+        __atomic_exchange_n(&heap->remote[cls], NULL, __ATOMIC_ACQUIRE);
+    if (list)
+        return list;
+
+    char *slab = mmap(NULL, ALLOC_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == slab)
+        return NULL;
+    *(void **) slab = heap->slabs;
+    heap->slabs = slab;
+
+    /* the first ALLOC_ALIGN bytes of a slab link it into heap->slabs */
+    size_t stride = sizeof(blk_hdr) + ((size_t) 1 << (cls + ALLOC_MIN_SHIFT));
+    for (char *p = slab + ALLOC_ALIGN; p + stride <= slab + ALLOC_SLAB_SIZE;
+         p += stride) {
+        blk_hdr *hdr = (blk_hdr *) p;
+        free_blk *blk = (free_blk *) (hdr + 1);
+        hdr->owner = k;
+        hdr->cls = cls;
+        blk->next = list;
+        list = blk;
+    }
+    return list;
+}
+
+/* malloc() and free() keep per-thread caches, so a user-level thread must
+ * not move to another worker halfway through them; out of line, as callers
+ * may go on to getcontext()
+ */
+static __attribute__((noinline)) void *heap_alloc(size_t size)
+{
+    preempt_disable();
+    void *ptr = malloc(size);
+    preempt_enable();
+    return ptr;
+}
+
+static void heap_free(void *ptr)
+{
+    preempt_disable();
+    free(ptr);
+    preempt_enable();
+}
+
+/* allocate memory from the fiber-aware allocator */
+void *fiber_alloc(size_t size)
+{
+    uint cls = alloc_class(size);
+
+    if (cls < ALLOC_CLASSES) {
+        free_blk *blk = NULL;
+
+        preempt_disable();
+        int k = k_thread_self();
+        if (k >= 0) {
+            k_heap *heap = &k_heaps[k];
+            if (!heap->local[cls])
+                heap->local[cls] = alloc_refill(heap, k, cls);
+            blk = heap->local[cls];
+            if (blk)
+                heap->local[cls] = blk->next;
+        }
+        preempt_enable();
+
+        if (blk)
+            return blk;
+    }
+
+    blk_hdr *hdr = heap_alloc(sizeof(blk_hdr) + size);
+    if (!hdr)
+        return NULL;
+    hdr->owner = ALLOC_HEAP;
+    hdr->cls = cls;
+    return hdr + 1;
+}
+
+/* release memory obtained from fiber_alloc(), from any thread */
+void fiber_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    blk_hdr *hdr = (blk_hdr *) ptr - 1;
+    free_blk *blk = ptr;
+    if (ALLOC_HEAP == hdr->owner) {
+        heap_free(hdr);
+        return;
+    }
+
+    k_heap *heap = &k_heaps[hdr->owner];
+    preempt_disable();
+    if (k_thread_self() == (int) hdr->owner) {
+        blk->next = heap->local[hdr->cls];
+        heap->local[hdr->cls] = blk;
+    } else {
+        /* lock-free push, the owner detaches the whole list at once */
+        free_blk *head =
+            __atomic_load_n(&heap->remote[hdr->cls], __ATOMIC_RELAXED);
+        do {
+            blk->next = head;
+        } while (!__atomic_compare_exchange_n(&heap->remote[hdr->cls], &head,
+                                              blk, true, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+    }
+    preempt_enable();
+}
+
+/* bump-allocate from the arena of the calling user-level thread */
+void *fiber_arena_alloc(size_t size)
+{
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb)
+        return NULL;
+
+    struct _arena *arena = cur_tcb->arena;
+    size = (size + ALLOC_ALIGN - 1) & ~((size_t) ALLOC_ALIGN - 1);
+    if (!arena || arena->used + size > arena->size) {
+        size_t chunk = sizeof(struct _arena) + size;
+        if (chunk < ARENA_CHUNK)
+            chunk = ARENA_CHUNK;
+        arena = fiber_alloc(chunk);
+        if (!arena)
+            return NULL;
+        arena->size = chunk - sizeof(struct _arena);
+        arena->used = 0;
+        arena->next = cur_tcb->arena;
+        cur_tcb->arena = arena;
+    }
+
+    void *ptr = (char *) (arena + 1) + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+/* release every arena chunk of a user-level thread at once */
+static void arena_release(_tcb *thread)
+{
+    while (thread->arena) {
+        struct _arena *next = thread->arena->next;
+        fiber_free(thread->arena);
+        thread->arena = next;
+    }
+}
+
+/* obtain a TCB, recycling one released earlier whenever possible; the
+ * caller records the stack size in it
+ */
+static _tcb *tcb_alloc(size_t stack_size)
+{
+    list_node *node = NULL;
+
+    /* only TCBs with the default stack size are recycled */
+    if (_THREAD_STACK != stack_size)
+        return heap_alloc(sizeof(_tcb) + 1 + stack_size);
+
+    preempt_disable();
+    int k = k_thread_self();
+    if (k >= 0 && k_heaps[k].tcb_cache) {
+        node = k_heaps[k].tcb_cache;
+        k_heaps[k].tcb_cache = node->next;
+        k_heaps[k].tcb_cached--;
+    }
+    preempt_enable();
+
+    if (!node) {
+        spin_lock(&tcb_depot_lock);
+        node = tcb_depot;
+        if (node)
+            tcb_depot = node->next;
+        spin_unlock(&tcb_depot_lock);
+    }
+
+    if (node)
+        return GET_TCB(node);
+    return heap_alloc(sizeof(_tcb) + 1 + _THREAD_STACK);
+}
+
+/* recycle a TCB, keeping up to TCB_CACHE_MAX of them on the calling worker */
+static void tcb_free(_tcb *thread)
+{
+    if (_THREAD_STACK != thread->stack_size) {
+        heap_free(thread);
+        return;
+    }
+
+    preempt_disable();
+    int k = k_thread_self();
+    if (k >= 0 && k_heaps[k].tcb_cached < TCB_CACHE_MAX) {
+        thread->node.next = k_heaps[k].tcb_cache;
+        k_heaps[k].tcb_cache = &thread->node;
+        k_heaps[k].tcb_cached++;
+        thread = NULL;
+    }
+    preempt_enable();
+
+    if (thread) {
+        spin_lock(&tcb_depot_lock);
+        thread->node.next = tcb_depot;
+        tcb_depot = &thread->node;
+        spin_unlock(&tcb_depot_lock);
+    }
+}
+
+/* Stack usage accounting
+ *
+ * With stack statistics enabled, stacks are painted with a canary at
+ * creation. When a thread terminates, the depth of the untouched canary
+ * gives its high-water mark, which is reported and folded into the entry of
+ * its entry function. The same entries carry the stack size hints applied to
+ * new threads of that entry function.
+ */
+typedef struct {
+    void (*entry)(void *); /* entry function, NULL if unused */
+    size_t hint;           /* stack size of new threads, 0 for default */
+    size_t peak;           /* deepest stack usage measured */
+    size_t size;           /* stack size of the deepest thread */
+    unsigned long count;   /* threads measured */
+} stack_site;
+
+static stack_site stack_sites[STACK_SITES];
+static uint stack_sites_lock = 0;
+static bool stack_stats = false;
+static bool stack_hints = false;
+
+/* entry of an entry function, added if asked to, with stack_sites_lock held */
+static stack_site *stack_site_get(void (*entry)(void *), bool add)
+{
+    uint h = (uint) (((uintptr_t) entry >> 4) % STACK_SITES);
+
+    for (uint i = 0; i < STACK_SITES; i++) {
+        stack_site *site = &stack_sites[(h + i) % STACK_SITES];
+        if (site->entry == entry)
+            return site;
+        if (!site->entry) {
+            if (!add)
+                return NULL;
+            site->entry = entry;
+            return site;
+        }
+    }
+    return NULL;
+}
+
+/* lowest canary word of a stack, which grows downwards */
+static inline uint64_t *stack_bottom(_tcb *thread)
+{
+    uintptr_t p = ((uintptr_t) thread->stack + 7) & ~(uintptr_t) 7;
+    return (uint64_t *) p;
+}
+
+static void stack_paint(_tcb *thread)
+{
+    uint64_t *p = stack_bottom(thread);
+    uint64_t *end = (uint64_t *) (thread->stack + thread->stack_size);
+
+    while (p < end)
+        *p++ = STACK_CANARY;
+}
+
+/* bytes of a painted stack which were written to */
+static size_t stack_used(_tcb *thread)
+{
+    uint64_t *p = stack_bottom(thread);
+    char *end = thread->stack + thread->stack_size;
+
+    while ((char *) p < end && STACK_CANARY == *p)
+        p++;
+    return end - (char *) p;
+}
+
+/* report the high-water mark of a terminated thread */
+static void stack_account(_tcb *thread)
+{
+    size_t used = stack_used(thread);
+
+    fprintf(stderr, "fiber %u: entry %p used %zu of %zu stack bytes%s\n",
+            thread->tid, (void *) (uintptr_t) thread->entry, used,
+            thread->stack_size,
+            STACK_CANARY != *stack_bottom(thread) ? " (overflow?)" : "");
+
+    spin_lock(&stack_sites_lock);
+    stack_site *site = stack_site_get(thread->entry, true);
+    if (site) {
+        site->count++;
+        if (used >= site->peak) {
+            site->peak = used;
+            site->size = thread->stack_size;
+        }
+    }
+    spin_unlock(&stack_sites_lock);
+}
+
+/* stack size of a new thread without an explicit one */
+static size_t stack_size_of(void (*entry)(void *))
+{
+    size_t size = 0;
+
+    if (!__atomic_load_n(&stack_hints, __ATOMIC_ACQUIRE))
+        return _THREAD_STACK;
+
+    spin_lock(&stack_sites_lock);
+    stack_site *site = stack_site_get(entry, false);
+    if (site)
+        size = site->hint;
+    spin_unlock(&stack_sites_lock);
+    return size ? size : _THREAD_STACK;
+}
+
+/* enable or disable stack statistics for threads created from now on */
+int fiber_stack_stats(int enable)
+{
+    __atomic_store_n(&stack_stats, !!enable, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* set the stack size of new threads starting at an entry function */
+int fiber_stack_hint(void (*start_func)(void *), size_t size)
+{
+    if (size && size < STACK_MIN)
+        return -1;
+
+    spin_lock(&stack_sites_lock);
+    stack_site *site = stack_site_get(start_func, true);
+    if (site)
+        site->hint = (size + 15) & ~(size_t) 15;
+    spin_unlock(&stack_sites_lock);
+
+    if (!site)
+        return -1;
+    __atomic_store_n(&stack_hints, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* deepest stack usage measured for an entry function */
+size_t fiber_stack_peak(void (*start_func)(void *))
+{
+    size_t peak = 0;
+
+    spin_lock(&stack_sites_lock);
+    stack_site *site = stack_site_get(start_func, false);
+    if (site)
+        peak = site->peak;
+    spin_unlock(&stack_sites_lock);
+    return peak;
+}
+
+static void *k_thread_exec_func(void *arg);
+static bool task_queued();
+static void u_thread_inherit(_tcb *thread);
+static void u_thread_exec_func(void (*thread_func)(void *),
+                               void *arg,
+                               _tcb *thread);
+
+int fiber_init(int num)
+{
+    if (num <= 0 || num > K_THREAD_MAX || thread_nums)
+        return -1;
+
+    /* Initialize timeslice */
+    timeslice.it_value.tv_sec = 0;
+    timeslice.it_value.tv_nsec = TIME_SLICE * 1000;
+    timeslice.it_interval.tv_sec = 0;
+    timeslice.it_interval.tv_nsec = TIME_SLICE * 1000;
+
+    for (int i = 0; i < PRIORITY; i++)
+        thread_queue[i].prev = thread_queue[i].next = &thread_queue[i];
+    all_threads.prev = all_threads.next = &all_threads;
+    for (int i = 0; i < num; i++) {
+        task_deque[i].prev = task_deque[i].next = &task_deque[i];
+        edf_queue[i].size = 0;
+        edf_queue[i].top = UINT64_MAX;
+        edf_queue[i].top_k = -1;
+        k_thread_due[i] = 0;
+        k_thread_queue[i].prev = k_thread_queue[i].next = &k_thread_queue[i];
+        k_thread_turn[i] = false;
+        k_shared_owner[i] = NULL;
+        k_thread_kick_armed[i] = true;
+    }
+
+    k_thread_shutdown = false;
+    k_thread_cancel_all = false;
+    k_thread_drain_due = UINT64_MAX;
+    thread_nums = num;
+
+    /* workers are pthreads, each with TLS of its own; tasks run on their
+     * stacks, whose pages only become resident once touched
+     */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, K_THREAD_STACK);
+
+    for (int i = 0; i < num; i++) {
+        /* pages of the shared stack only become resident once touched */
+        k_shared_stack[i] =
+            mmap(NULL, SHARED_STACK, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (MAP_FAILED == k_shared_stack[i]) {
+            perror("Failed to map the shared stack!");
+            k_shared_stack[i] = NULL;
+            thread_nums = i;
+            pthread_attr_destroy(&attr);
+            fiber_destroy();
+            return -1;
+        }
+
+        if (pthread_create(&k_thread[i], &attr, k_thread_exec_func,
+                           (void *) (intptr_t) i)) {
+            perror("Failed to create a worker thread.");
+            munmap(k_shared_stack[i], SHARED_STACK);
+            k_shared_stack[i] = NULL;
+            thread_nums = i;
+            pthread_attr_destroy(&attr);
+            fiber_destroy();
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+/* whether worker k may run the first thread of the heap of worker j */
+static inline bool edf_runnable(int j, int k)
+{
+    int top_k = __atomic_load_n(&edf_queue[j].top_k, __ATOMIC_SEQ_CST);
+    return top_k < 0 || top_k == k;
+}
+
+/* whether worker k has a runnable EDF thread, any worker if k is -1 */
+static bool edf_queued(int k)
+{
+    for (int j = 0; j < thread_nums; j++) {
+        if (__atomic_load_n(&edf_queue[j].top, __ATOMIC_SEQ_CST) !=
+                UINT64_MAX &&
+            (k < 0 || edf_runnable(j, k)))
+            return true;
+    }
+    return false;
+}
+
+/* publish the first thread of a heap, with its lock held */
+static inline void edf_update(edf_heap *heap)
+{
+    _tcb *top = heap->size ? heap->thread[0] : NULL;
+    __atomic_store_n(&heap->top_k, top ? top->k_bound : -1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&heap->top, top ? top->edf_due : UINT64_MAX,
+                     __ATOMIC_SEQ_CST);
+}
+
+static inline void edf_swap(edf_heap *heap, int i, int j)
+{
+    _tcb *thread = heap->thread[i];
+    heap->thread[i] = heap->thread[j];
+    heap->thread[j] = thread;
+}
+
+/* make room for one more EDF thread in the heap of every worker, as any of
+ * them may end up holding all; -1 if out of memory
+ */
+static __attribute__((noinline)) int edf_reserve()
+{
+    int n = __atomic_add_fetch(&edf_threads, 1, __ATOMIC_SEQ_CST);
+
+    for (int k = 0; k < thread_nums; k++) {
+        edf_heap *heap = &edf_queue[k];
+        while (__atomic_load_n(&heap->capacity, __ATOMIC_ACQUIRE) < n) {
+            int capacity = n < 64 ? 64 : 2 * n;
+            _tcb **thread = heap_alloc(capacity * sizeof(_tcb *));
+            if (!thread) {
+                __atomic_sub_fetch(&edf_threads, 1, __ATOMIC_SEQ_CST);
+                return -1;
+            }
+            spin_lock(&heap->lock);
+            if (heap->capacity < capacity) {
+                _tcb **old = heap->thread;
+                memcpy(thread, old, heap->size * sizeof(_tcb *));
+                heap->thread = thread;
+                __atomic_store_n(&heap->capacity, capacity, __ATOMIC_RELEASE);
+                thread = old;
+            }
+            spin_unlock(&heap->lock);
+            heap_free(thread);
+        }
+    }
+    return 0;
+}
+
+/* insert into the EDF heap of worker k */
+static void edf_push(int k, _tcb *thread)
+{
+    edf_heap *heap = &edf_queue[k];
+
+    spin_lock(&heap->lock);
+    int i = heap->size++;
+    heap->thread[i] = thread;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap->thread[parent]->edf_due <= heap->thread[i]->edf_due)
+            break;
+        edf_swap(heap, parent, i);
+        i = parent;
+    }
+    edf_update(heap);
+    spin_unlock(&heap->lock);
+}
+
+/* take the thread with the earliest deadline of all workers, the own one
+ * on ties, so that a worker steals only what is due before its own work
+ */
+static _tcb *edf_pop(int k)
+{
+    uint64_t earliest = UINT64_MAX;
+    int victim = -1;
+    _tcb *thread = NULL;
+
+    for (int i = 0; i < thread_nums; i++) {
+        int j = (k + i) % thread_nums;
+        uint64_t top = __atomic_load_n(&edf_queue[j].top, __ATOMIC_SEQ_CST);
+        if (top < earliest && edf_runnable(j, k)) {
+            earliest = top;
+            victim = j;
+        }
+    }
+    if (victim < 0)
+        return NULL;
+
+    edf_heap *heap = &edf_queue[victim];
+    spin_lock(&heap->lock);
+    if (heap->size &&
+        (heap->thread[0]->k_bound < 0 || heap->thread[0]->k_bound == k)) {
+        thread = heap->thread[0];
+        heap->thread[0] = heap->thread[--heap->size];
+        for (int i = 0;;) {
+            int min = i, l = 2 * i + 1, r = 2 * i + 2;
+            if (l < heap->size &&
+                heap->thread[l]->edf_due < heap->thread[min]->edf_due)
+                min = l;
+            if (r < heap->size &&
+                heap->thread[r]->edf_due < heap->thread[min]->edf_due)
+                min = r;
+            if (min == i)
+                break;
+            edf_swap(heap, i, min);
+            i = min;
+        }
+        edf_update(heap);
+    }
+    spin_unlock(&heap->lock);
+    return thread;
+}
+
+/* make a runnable EDF thread preempt the worker running the latest deadline,
+ * when none is idle
+ */
+static void k_thread_preempt()
+{
+    uint64_t due = UINT64_MAX;
+    int victim = -1;
+
+    for (int k = 0; k < thread_nums; k++) {
+        uint64_t top = __atomic_load_n(&edf_queue[k].top, __ATOMIC_SEQ_CST);
+        if (top < due)
+            due = top;
+    }
+    for (int k = 0; k < thread_nums; k++) {
+        uint64_t running = __atomic_load_n(&k_thread_due[k], __ATOMIC_SEQ_CST);
+        if (running > due) {
+            due = running;
+            victim = k;
+        }
+    }
+
+    /* schedule() on that worker puts its thread back to the run queue */
+    if (victim >= 0)
+        pthread_kill(k_thread[victim], SIGPROF);
+}
+
+/* whether to look at worker k: any one, or only one running no thread, which
+ * may be idle, if @idle is set
+ */
+static inline bool k_thread_counts(int k, bool idle)
+{
+    return !idle || !__atomic_load_n(&cur_thread_node[k], __ATOMIC_SEQ_CST);
+}
+
+/* whether a runnable thread waits for the one worker it is bound to, see
+ * k_thread_counts() for @idle
+ */
+static bool k_thread_bound_queued(bool idle)
+{
+    for (int k = 0; k < thread_nums; k++) {
+        int top_k = __atomic_load_n(&edf_queue[k].top_k, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&k_thread_queue[k].next, __ATOMIC_SEQ_CST) !=
+                &k_thread_queue[k] &&
+            k_thread_counts(k, idle))
+            return true;
+        if (top_k >= 0 && k_thread_counts(top_k, idle))
+            return true;
+    }
+    return false;
+}
+
+/* whether the run-next slot of a worker is filled */
+static bool k_thread_next_queued(bool idle)
+{
+    for (int k = 0; k < thread_nums; k++) {
+        if (__atomic_load_n(&k_thread_next[k], __ATOMIC_SEQ_CST) &&
+            k_thread_counts(k, idle))
+            return true;
+    }
+    return false;
+}
+
+/* whether any worker may pick up runnable work */
+static bool k_thread_queued()
+{
+    for (int i = 0; i < PRIORITY; i++) {
+        if (__atomic_load_n(&thread_queue[i].next, __ATOMIC_SEQ_CST) !=
+            &thread_queue[i])
+            return true;
+    }
+    return edf_queued(-1) || task_queued();
+}
+
+/* have worker k kick an idle worker after delay ns, unless already set */
+static void k_thread_arm_kick(int k, uint64_t delay)
+{
+    if (__atomic_exchange_n(&k_thread_kick_armed[k], true, __ATOMIC_SEQ_CST))
+        return;
+
+    struct itimerspec kick = {
+        .it_value = {.tv_sec = delay / 1000000000,
+                     .tv_nsec = delay % 1000000000 ?: 1},
+    };
+    timer_settime(k_thread_kick_timer[k], 0, &kick, NULL);
+}
+
+/* signal handler of the kick timer: hand the run-next slot of the worker
+ * over to an idle one once it is due, or wait for the rest of the grace
+ * period of a newer handoff
+ */
+static void k_thread_kick(int sig)
+{
+    int saved_errno = errno;
+    int k = k_thread_self();
+
+    (void) sig;
+    if (k < 0)
+        return;
+    __atomic_store_n(&k_thread_kick_armed[k], false, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&k_thread_next[k], __ATOMIC_SEQ_CST)) {
+        uint64_t since =
+            __atomic_load_n(&k_thread_next_since[k], __ATOMIC_RELAXED);
+        uint64_t now = now_ns();
+        if (now - since >= RUNNEXT_GRACE) {
+            __atomic_add_fetch(&k_thread_idle_seq, 1, __ATOMIC_SEQ_CST);
+            futex(&k_thread_idle_seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+        } else
+            k_thread_arm_kick(k, since + RUNNEXT_GRACE - now);
+    }
+    errno = saved_errno;
+}
+
+/* wake up an idle worker, if any, to pick up newly runnable threads */
+static void k_thread_wakeup(int n)
+{
+    int idle = __atomic_load_n(&k_thread_idle, __ATOMIC_SEQ_CST);
+    if (idle) {
+        /* idle workers cannot be told apart, so all of them look for the
+         * threads which only one of them may run; a busy worker gets to its
+         * own ones by itself
+         */
+        if (k_thread_bound_queued(true) || k_thread_next_queued(true))
+            n = INT_MAX;
+        /* handoffs to busy workers are left to their kick timers */
+        else if (!k_thread_queued())
+            return;
+        __atomic_add_fetch(&k_thread_idle_seq, 1, __ATOMIC_SEQ_CST);
+        futex(&k_thread_idle_seq, FUTEX_WAKE_PRIVATE, n, NULL);
+    } else if (edf_queued(-1))
+        k_thread_preempt();
+}
+
+/* sleep until new work is queued for worker k or the runtime shuts down */
+static void k_thread_idle_wait(int k)
+{
+    __atomic_add_fetch(&k_thread_idle, 1, __ATOMIC_SEQ_CST);
+    uint seq = __atomic_load_n(&k_thread_idle_seq, __ATOMIC_SEQ_CST);
+
+    /* recheck after announcing ourselves idle, or a wakeup may be lost */
+    bool empty = true;
+    spin_lock(&_spinlock);
+    for (int i = 0; i < PRIORITY && empty; i++)
+        empty = is_queue_empty(&thread_queue[i]);
+    empty = empty && is_queue_empty(&k_thread_queue[k]) && !k_thread_next[k];
+
+    /* handoffs filled while no worker was idle have no kick timer set yet */
+    for (int j = 0; j < thread_nums && empty; j++) {
+        if (k_thread_next[j]) {
+            uint64_t now = now_ns();
+            if (now - k_thread_next_since[j] >= RUNNEXT_GRACE)
+                empty = false;
+            else
+                k_thread_arm_kick(j,
+                                  k_thread_next_since[j] + RUNNEXT_GRACE - now);
+        }
+    }
+    spin_unlock(&_spinlock);
+    empty = empty && !edf_queued(k) && !task_queued();
+
+    if (empty && !__atomic_load_n(&k_thread_shutdown, __ATOMIC_SEQ_CST)) {
+        /* do not oversleep the earliest deadline */
+        struct timespec timeout, *tp = NULL;
+        uint64_t deadline = __atomic_load_n(&next_deadline, __ATOMIC_RELAXED);
+        if (deadline != UINT64_MAX) {
+            uint64_t now = now_ns();
+            uint64_t delta = deadline > now ? deadline - now : 0;
+            timeout.tv_sec = delta / 1000000000;
+            timeout.tv_nsec = delta % 1000000000;
+            tp = &timeout;
+        }
+        futex(&k_thread_idle_seq, FUTEX_WAIT_PRIVATE, seq, tp);
+    }
+    __atomic_sub_fetch(&k_thread_idle, 1, __ATOMIC_SEQ_CST);
+}
+
+/* put a runnable user-level thread on its run queue, with _spinlock held */
+static void u_thread_ready(_tcb *thread)
+{
+    if (EDF == thread->policy) {
+        /* the heap of the waking worker, other workers steal by deadline */
+        int k = thread->k_bound;
+        if (k < 0)
+            k = k_thread_self();
+        edf_push(k >= 0 ? k : (int) (thread->tid % thread_nums), thread);
+    } else if (thread->k_bound >= 0)
+        enqueue(&k_thread_queue[thread->k_bound], &thread->node);
+    else
+        enqueue(thread_queue + thread->prio, &thread->node);
+}
+
+/* whether a thread of a higher priority than prio is queued, with _spinlock
+ * held; the run-next slot must not jump ahead of it
+ */
+static bool u_thread_outranked(int prio)
+{
+    for (int i = 0; i < prio; i++) {
+        if (!is_queue_empty(&thread_queue[i]))
+            return true;
+    }
+    return false;
+}
+
+/* put a woken user-level thread next to its waker, with _spinlock held: into
+ * the run-next slot of the worker it prefers, else of the worker of the waker,
+ * else of the one it ran on last. Bound and EDF threads, and threads of a
+ * lower priority than some queued one, are queued as usual.
+ */
+static void u_thread_ready_near(_tcb *thread)
+{
+    int k = thread->k_hint;
+    if (k < 0)
+        k = k_thread_self();
+    if (k < 0)
+        k = thread->k_last;
+    if (k < 0 || EDF == thread->policy || thread->k_bound >= 0 ||
+        u_thread_outranked(thread->prio)) {
+        u_thread_ready(thread);
+        return;
+    }
+
+    /* the one it displaces goes back to the run queue */
+    _tcb *prev = k_thread_next[k];
+    if (prev)
+        enqueue(thread_queue + prev->prio, &prev->node);
+    k_thread_next_since[k] = now_ns();
+    __atomic_store_n(&k_thread_next[k], thread, __ATOMIC_SEQ_CST);
+
+    /* idle workers sleep instead of watching the slot */
+    if (__atomic_load_n(&k_thread_idle, __ATOMIC_SEQ_CST))
+        k_thread_arm_kick(k, RUNNEXT_GRACE);
+}
+
+/* take over a handoff which another worker has not picked up within
+ * RUNNEXT_GRACE, with _spinlock held
+ */
+static bool k_thread_steal_next(int k, list_node **node)
+{
+    uint64_t now = 0;
+
+    for (int i = 1; i < thread_nums; i++) {
+        int j = (k + i) % thread_nums;
+        if (!k_thread_next[j])
+            continue;
+        if (!now)
+            now = now_ns();
+        if (now - k_thread_next_since[j] >= RUNNEXT_GRACE) {
+            *node = &k_thread_next[j]->node;
+            __atomic_store_n(&k_thread_next[j], NULL, __ATOMIC_SEQ_CST);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* make a user-level thread runnable from anywhere but its own worker */
+static void u_thread_wakeup(_tcb *thread)
+{
+    spin_lock(&_spinlock);
+    u_thread_ready(thread);
+    spin_unlock(&_spinlock);
+    k_thread_wakeup(1);
+}
+
+/* move a blocked user-level thread to the run queue, with _spinlock held */
+static inline void u_thread_unblock(_tcb *thread)
+{
+    list_remove(&thread->node);
+    thread->wait_list = NULL;
+    thread->waiting_on = NULL;
+    u_thread_ready_near(thread);
+}
+
+/* cancel the threads past their deadline, waking up the blocked ones */
+static void k_thread_expire()
+{
+    uint64_t now = now_ns();
+    uint64_t next = UINT64_MAX;
+    int woken = 0;
+
+    if (now < __atomic_load_n(&next_deadline, __ATOMIC_RELAXED))
+        return;
+
+    spin_lock(&_spinlock);
+    for (list_node *node = all_threads.next; node != &all_threads;
+         node = node->next) {
+        _tcb *thread = GET_TCB_LINK(node);
+        if (!thread->deadline)
+            continue;
+        if (thread->deadline > now) {
+            if (thread->deadline < next)
+                next = thread->deadline;
+            continue;
+        }
+
+        thread->deadline = 0;
+        __atomic_store_n(&thread->canceled, true, __ATOMIC_RELEASE);
+        if (thread->wait_list) {
+            u_thread_unblock(thread);
+            woken++;
+        }
+    }
+    __atomic_store_n(&next_deadline, next, __ATOMIC_RELAXED);
+    spin_unlock(&_spinlock);
+
+    if (woken)
+        k_thread_wakeup(woken);
+}
+
+/* cancel every thread, waking up the blocked ones, with _spinlock held */
+static int k_thread_cancel_remaining()
+{
+    int woken = 0;
+
+    for (list_node *node = all_threads.next; node != &all_threads;
+         node = node->next) {
+        _tcb *thread = GET_TCB_LINK(node);
+        __atomic_store_n(&thread->canceled, true, __ATOMIC_RELEASE);
+        if (thread->wait_list) {
+            u_thread_unblock(thread);
+            woken++;
+        }
+    }
+    return woken;
+}
+
+/* release what a terminated user-level thread holds, on its last worker */
+static void u_thread_reclaim(_tcb *thread)
+{
+    if (thread->entry)
+        stack_account(thread);
+
+    /* nothing to save of the frames of a terminated thread */
+    if (thread->shared) {
+        if (k_shared_owner[thread->k_bound] == thread)
+            k_shared_owner[thread->k_bound] = NULL;
+        fiber_free(thread->saved);
+        thread->saved = NULL;
+    }
+
+    sig_sem *sem = sigsem_of(thread->tid);
+    int woken = 0;
+
+    if (EDF == thread->policy)
+        __atomic_sub_fetch(&edf_threads, 1, __ATOMIC_SEQ_CST);
+
+    spin_lock(&_spinlock);
+    list_remove(&thread->link);
+    sem->thread = NULL;
+    user_thread_num--;
+
+    /* mutexes it still holds must not lend priority to a recycled TCB */
+    list_node *node = NULL;
+    while (dequeue(&thread->held, &node))
+        __atomic_store_n(&GET_MUTEX(node)->owner, NULL, __ATOMIC_SEQ_CST);
+
+    sem->exited = true;
+    while (!is_queue_empty(&sem->joiners)) {
+        u_thread_unblock(GET_TCB(sem->joiners.next));
+        woken++;
+    }
+    spin_unlock(&_spinlock);
+
+    /* do V() in thread semaphore implies that current user-level thread is
+     * done; it is the last access to the slot of the ID, which the joiner
+     * may release right away. Posting after _spinlock is dropped keeps a
+     * native joiner from spinning on it as soon as it wakes up.
+     */
+    sem_post(&sem->semaphore);
+
+    if (woken)
+        k_thread_wakeup(woken);
+    tcb_free(thread);
+}
+
+/* shut down the runtime, canceling the threads still runnable at drain_due */
+static void k_thread_destroy(uint64_t drain_due)
+{
+    list_node *node = NULL;
+
+    if (!thread_nums)
+        return;
+
+    /* let the workers drain the run queue; each one exits once it finds the
+     * queue empty, and the last one cancels the threads which are still
+     * blocked, so that they unwind before it leaves. Threads still runnable
+     * at drain_due are canceled too, acting on it at their next park point.
+     */
+    __atomic_store_n(&k_thread_drain_due, drain_due, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&k_thread_shutdown, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&k_thread_idle_seq, 1, __ATOMIC_SEQ_CST);
+    futex(&k_thread_idle_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+
+    for (int k = 0; k < thread_nums; k++) {
+        pthread_join(k_thread[k], NULL);
+        cur_thread_node[k] = NULL;
+        munmap(k_shared_stack[k], SHARED_STACK);
+        k_shared_stack[k] = NULL;
+        k_shared_owner[k] = NULL;
+        k_thread_next[k] = NULL;
+        k_thread_handoffs[k] = 0;
+    }
+
+    /* whatever is left got blocked again while unwinding */
+    while (dequeue(&all_threads, &node)) {
+        _tcb *thread = GET_TCB_LINK(node);
+        while (thread->cleanup) {
+            struct _cleanup *next = thread->cleanup->next;
+            fiber_free(thread->cleanup);
+            thread->cleanup = next;
+        }
+        arena_release(thread);
+        fiber_free(thread->saved);
+        free(thread);
+    }
+    user_thread_num = 0;
+    next_deadline = UINT64_MAX;
+
+    for (int k = 0; k < K_THREAD_MAX; k++) {
+        free(edf_queue[k].thread);
+        edf_queue[k].thread = NULL;
+        edf_queue[k].capacity = 0;
+    }
+    edf_threads = 0;
+
+    /* IDs which were never joined go along with their slots */
+    for (fiber_t id = 0; id < sigsem_next; id++) {
+        sig_sem *sem = sigsem_of(id);
+        if (sem->used) {
+            sem_destroy(&sem->semaphore);
+            fiber_free(sem->val);
+        }
+    }
+    for (uint c = 0; c < U_THREAD_MAX / SIGSEM_CHUNK && sigsem_chunk[c]; c++) {
+        munmap(sigsem_chunk[c], SIGSEM_CHUNK * sizeof(sig_sem));
+        sigsem_chunk[c] = NULL;
+    }
+    sigsem_next = 0;
+    sigsem_free = U_THREAD_MAX;
+
+    /* return the pools to the system */
+    for (int k = 0; k < thread_nums; k++) {
+        k_heap *heap = &k_heaps[k];
+        while (heap->tcb_cache) {
+            node = heap->tcb_cache;
+            heap->tcb_cache = node->next;
+            free(GET_TCB(node));
+        }
+        while (heap->slabs) {
+            void *slab = heap->slabs;
+            heap->slabs = *(void **) slab;
+            munmap(slab, ALLOC_SLAB_SIZE);
+        }
+        memset(heap, 0, sizeof(k_heap));
+    }
+    while (tcb_depot) {
+        node = tcb_depot;
+        tcb_depot = node->next;
+        free(GET_TCB(node));
+    }
+
+    /* summarize the stack usage per entry function */
+    for (int i = 0; i < STACK_SITES; i++) {
+        stack_site *site = &stack_sites[i];
+        if (site->count)
+            fprintf(stderr,
+                    "stack: entry %p: %lu fibers, peak %zu of %zu bytes\n",
+                    (void *) (uintptr_t) site->entry, site->count, site->peak,
+                    site->size);
+    }
+    memset(stack_sites, 0, sizeof(stack_sites));
+    stack_stats = false;
+    stack_hints = false;
+
+    thread_nums = 0;
+}
+
+void fiber_destroy()
+{
+    k_thread_destroy(UINT64_MAX);
+}
+
+void fiber_destroy_timeout(unsigned long usec)
+{
+    uint64_t now = now_ns();
+    uint64_t limit = (UINT64_MAX - 1 - now) / 1000;
+
+    k_thread_destroy(now + (usec < limit ? usec : limit) * 1000);
+}
+
+/* initialize thread attributes */
+int fiber_attr_init(fiber_attr_t *attr)
+{
+    attr->policy = RR;
+    attr->deadline = 0;
+    attr->stacksize = 0;
+    attr->sharedstack = 0;
+    attr->priority = 0;
+    return 0;
+}
+
+/* set the stack size, 0 for the default */
+int fiber_attr_setstacksize(fiber_attr_t *attr, size_t size)
+{
+    if (size && size < STACK_MIN)
+        return -1;
+    attr->stacksize = (size + 15) & ~(size_t) 15;
+    return 0;
+}
+
+/* set the scheduling policy */
+int fiber_attr_setschedpolicy(fiber_attr_t *attr, int policy)
+{
+    if (RR != policy && EDF != policy)
+        return -1;
+    attr->policy = policy;
+    return 0;
+}
+
+/* set the relative deadline of an EDF thread */
+int fiber_attr_setdeadline(fiber_attr_t *attr, unsigned long usec)
+{
+    attr->deadline = usec;
+    return 0;
+}
+
+/* set the priority, 0 is the highest */
+int fiber_attr_setpriority(fiber_attr_t *attr, int prio)
+{
+    if (prio < 0 || prio > FIBER_PRIO_LOWEST)
+        return -1;
+    attr->priority = prio;
+    return 0;
+}
+
+/* run on the shared stack of a worker instead of a stack of its own */
+int fiber_attr_setsharedstack(fiber_attr_t *attr, int shared)
+{
+    attr->sharedstack = !!shared;
+    return 0;
+}
+
+/* create a new thread */
+int fiber_create(fiber_t *tid, void (*start_func)(void *), void *arg)
+{
+    return fiber_create_attr(tid, NULL, start_func, arg);
+}
+
+/* create a new thread with the given attributes */
+int fiber_create_attr(fiber_t *tid,
+                      const fiber_attr_t *attr,
+                      void (*start_func)(void *),
+                      void *arg)
+{
+    fiber_t id;
+    sig_sem *sem;
+
+    if (!thread_nums)
+        return -1;
+
+    /* pick a thread ID which is not taken */
+    id = sigsem_take();
+    if (id == U_THREAD_MAX) {
+        /* exceed ceiling limit of user lever threads */
+        perror("User level threads limit exceeded!");
+        return -1;
+    }
+    sem = sigsem_of(id);
+
+    /* EDF threads may all be queued on one worker */
+    bool edf = attr && EDF == attr->policy;
+    if (edf && edf_reserve()) {
+        perror("Failed to allocate space for the EDF run queues!");
+        sigsem_release(id);
+        return -1;
+    }
+
+    /* create a TCB for the new thread, with no stack if it is shared */
+    bool shared = attr && attr->sharedstack;
+    size_t stack_size =
+        attr && attr->stacksize ? attr->stacksize : stack_size_of(start_func);
+    if (shared)
+        stack_size = 0;
+    _tcb *thread = tcb_alloc(stack_size);
+    if (!thread) {
+        perror("Failed to allocate space for thread!");
+        if (edf)
+            __atomic_sub_fetch(&edf_threads, 1, __ATOMIC_SEQ_CST);
+        sigsem_release(id);
+        return -1;
+    }
+
+    thread->stack_size = stack_size;
+
+    /* set thread id and level */
+    thread->tid = id;
+    *tid = thread->tid;
+
+    /* EDF threads are due relative to their creation */
+    thread->policy = attr ? attr->policy : RR;
+    thread->edf_due = 0;
+    if (EDF == thread->policy)
+        thread->edf_due = now_ns() + (uint64_t) attr->deadline * 1000;
+
+    /* the highest priority unless asked otherwise, nothing inherited yet */
+    thread->prio = thread->base_prio =
+        attr && RR == attr->policy ? (uint) attr->priority : 0;
+    thread->held.next = thread->held.prev = &thread->held;
+    thread->waiting_on = NULL;
+
+    /* set node in thread run queue */
+    thread->node.next = thread->node.prev = NULL;
+
+    /* the arena is populated on first use */
+    thread->arena = NULL;
+
+    /* the frames of a shared-stack thread live at the addresses of the stack
+     * of one worker, where it has to run from then on
+     */
+    thread->shared = shared;
+    thread->k_bound = -1;
+    if (shared) {
+        preempt_disable();
+        thread->k_bound = k_thread_self();
+        preempt_enable();
+        if (thread->k_bound < 0)
+            thread->k_bound = (int) (id % thread_nums);
+    }
+    thread->stack_sp = NULL;
+    thread->saved = NULL;
+    thread->saved_size = 0;
+    thread->start_func = start_func;
+    thread->start_arg = arg;
+    thread->k_last = -1;
+    thread->k_hint = -1;
+
+    /* the high-water mark is measured against a painted stack */
+    thread->entry = NULL;
+    if (!shared && __atomic_load_n(&stack_stats, __ATOMIC_ACQUIRE)) {
+        thread->entry = start_func;
+        stack_paint(thread);
+    }
+
+    thread->canceled = false;
+    thread->cancel_type = FIBER_CANCEL_DEFERRED;
+    thread->deadline = 0;
+    thread->wait_list = NULL;
+    thread->cleanup = NULL;
+
+    /* initialize the slot of the thread ID */
+    sem->val = NULL;
+    sem->thread = thread;
+    sem->canceled = false;
+    sem->exited = false;
+    sem->joiners.prev = sem->joiners.next = &sem->joiners;
+    sem->park = PARK_EMPTY;
+    sem->parked.prev = sem->parked.next = &sem->parked;
+    sem_init(&sem->semaphore, 0, 0);
+
+    /* create a context for this user-level thread */
+    if (-1 == getcontext(&thread->context)) {
+        perror("Failed to get uesr context!");
+        sem_destroy(&sem->semaphore);
+        if (edf)
+            __atomic_sub_fetch(&edf_threads, 1, __ATOMIC_SEQ_CST);
+        sigsem_release(id);
+        tcb_free(thread);
+        return -1;
+    }
+
+    /* set the context to a newly allocated stack */
+    thread->context.uc_link = &context_main[0];
+    thread->context.uc_stack.ss_sp = thread->stack;
+    thread->context.uc_stack.ss_size = thread->stack_size;
+    thread->context.uc_stack.ss_flags = 0;
+
+    /* set the context, which calls a wrapper function and then start_func;
+     * the shared stack may be in use now, so its worker does that later.
+     */
+    if (shared) {
+        thread->context.uc_stack.ss_sp = k_shared_stack[thread->k_bound];
+        thread->context.uc_stack.ss_size = SHARED_STACK;
+    } else
+        makecontext(&thread->context, (void (*)(void)) & u_thread_exec_func, 3,
+                    start_func, arg, thread);
+
+    thread->status = NOT_STARTED;
+
+    /* add newly created thread to the user-level thread run queue */
+    spin_lock(&_spinlock);
+    enqueue(&all_threads, &thread->link);
+    user_thread_num++;
+    spin_unlock(&_spinlock);
+    u_thread_wakeup(thread);
+
+    return 0;
+}
+
+/* make room to save the used part of the shared stack of worker k for the
+ * calling thread, false if there is no memory for it
+ */
+static bool u_thread_stack_reserve(_tcb *thread, int k)
+{
+    size_t used = k_shared_stack[k] + SHARED_STACK - thread->stack_sp;
+    if (used <= thread->saved_size)
+        return true;
+
+    size_t size = (used + 255) & ~(size_t) 255;
+    void *saved = fiber_alloc(size);
+    if (!saved)
+        return false;
+    fiber_free(thread->saved);
+    thread->saved = saved;
+    thread->saved_size = size;
+    return true;
+}
+
+/* switch from the running user-level thread back to its worker, which carries
+ * out the action once the context of the thread has been saved completely.
+ */
+static void k_thread_switch(k_action action)
+{
+    /* re-enabled by the worker, after the switch */
+    preempt_disable();
+    int k = k_thread_self();
+    _tcb *cur_tcb = GET_TCB(cur_thread_node[k]);
+
+    /* frames below this one are dead once the context is saved; the room to
+     * save the rest is taken here, where running on is an option. A thread
+     * which blocks without it keeps the stack of the worker to itself.
+     */
+    if (cur_tcb->shared) {
+        cur_tcb->stack_sp = (char *) ((uintptr_t) &k - SHARED_STACK_SLACK);
+        if (cur_tcb->stack_sp < k_shared_stack[k])
+            cur_tcb->stack_sp = k_shared_stack[k];
+        if (K_ACTION_RECLAIM != action && !u_thread_stack_reserve(cur_tcb, k) &&
+            K_ACTION_READY == action) {
+            cur_tcb->status = RUNNING;
+            preempt_enable();
+            return;
+        }
+    }
+
+    k_thread_action[k] = action;
+    swapcontext(&(cur_tcb->context), &context_main[k]);
+
+    /* disabled by the worker which resumed this thread */
+    preempt_enable();
+}
+
+/* whether the thread has been canceled or has missed its deadline */
+static inline bool u_thread_expired(_tcb *thread)
+{
+    if (__atomic_load_n(&thread->canceled, __ATOMIC_ACQUIRE))
+        return true;
+
+    uint64_t deadline = __atomic_load_n(&thread->deadline, __ATOMIC_RELAXED);
+    if (deadline && now_ns() >= deadline) {
+        __atomic_store_n(&thread->canceled, true, __ATOMIC_RELEASE);
+        return true;
+    }
+    return false;
+}
+
+/* act on the cancellation of the calling thread, never returns */
+static void u_thread_unwind(_tcb *cur_tcb)
+{
+    sigsem_of(cur_tcb->tid)->canceled = true;
+    fiber_exit(NULL);
+}
+
+/* block the calling thread on a wait list, with _spinlock held; the worker
+ * drops the lock once the thread has switched out, so whoever unblocks it
+ * cannot miss it.
+ */
+static void u_thread_block(_tcb *cur_tcb, list_node *wait_list)
+{
+    enqueue(wait_list, &cur_tcb->node);
+    cur_tcb->wait_list = wait_list;
+    k_thread_switch(K_ACTION_UNLOCK);
+}
+
+/* give CPU pocession to other user-level threads voluntarily */
+int fiber_yield()
+{
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb)
+        return -1;
+
+    if (u_thread_expired(cur_tcb))
+        u_thread_unwind(cur_tcb);
+
+    if (RUNNING == cur_tcb->status) {
+        cur_tcb->status = SUSPENDED;
+        k_thread_switch(K_ACTION_READY);
+    }
+    return 0;
+}
+
+/* change the priority of the calling thread */
+int fiber_setpriority(int prio)
+{
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb || prio < 0 || prio > FIBER_PRIO_LOWEST)
+        return -1;
+
+    spin_lock(&_spinlock);
+    cur_tcb->base_prio = (uint) prio;
+    u_thread_inherit(cur_tcb);
+    spin_unlock(&_spinlock);
+    return 0;
+}
+
+/* bind a thread to a worker, or release it with -1 */
+int fiber_pin(fiber_t thread, int worker)
+{
+    _tcb *target = NULL;
+    bool queued = false;
+
+    sig_sem *sem = sigsem_of(thread);
+    if (!sem || worker < -1 || worker >= thread_nums)
+        return -1;
+
+    spin_lock(&_spinlock);
+    target = sem->thread;
+
+    /* the frames of a shared-stack thread cannot move */
+    if (!target || target->shared) {
+        spin_unlock(&_spinlock);
+        return -1;
+    }
+    target->k_bound = worker;
+
+    /* move it over if it waits to run somewhere else already */
+    for (int k = 0; k < thread_nums; k++) {
+        if (k_thread_next[k] == target) {
+            __atomic_store_n(&k_thread_next[k], NULL, __ATOMIC_SEQ_CST);
+            queued = true;
+        }
+    }
+    if (EDF == target->policy) {
+        /* the heaps publish the worker their first thread is bound to */
+        for (int k = 0; k < thread_nums; k++) {
+            spin_lock(&edf_queue[k].lock);
+            edf_update(&edf_queue[k]);
+            spin_unlock(&edf_queue[k].lock);
+        }
+    } else if (!target->wait_list && target->node.next) {
+        list_remove(&target->node);
+        queued = true;
+    }
+    if (queued)
+        u_thread_ready(target);
+    spin_unlock(&_spinlock);
+
+    k_thread_wakeup(1);
+    return 0;
+}
+
+/* let the wakeups of a thread prefer a worker, or drop the hint with -1 */
+int fiber_hint(fiber_t thread, int worker)
+{
+    _tcb *target = NULL;
+
+    sig_sem *sem = sigsem_of(thread);
+    if (!sem || worker < -1 || worker >= thread_nums)
+        return -1;
+
+    spin_lock(&_spinlock);
+    target = sem->thread;
+    if (target)
+        target->k_hint = worker;
+    spin_unlock(&_spinlock);
+
+    return target ? 0 : -1;
+}
+
+/* number of the worker running the caller */
+int fiber_worker()
+{
+    preempt_disable();
+    int k = k_thread_self();
+    preempt_enable();
+    return k;
+}
+
+/* ID of the calling thread */
+int fiber_self(fiber_t *tid)
+{
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb)
+        return -1;
+
+    *tid = cur_tcb->tid;
+    return 0;
+}
+
+/* consume the wake token of the calling thread, blocking until there is one */
+int fiber_park()
+{
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb)
+        return -1;
+
+    sig_sem *sem = sigsem_of(cur_tcb->tid);
+    if (u_thread_expired(cur_tcb))
+        u_thread_unwind(cur_tcb);
+
+    /* a token left by an earlier fiber_unpark() needs no lock */
+    uint token = PARK_TOKEN;
+    if (__atomic_compare_exchange_n(&sem->park, &token, PARK_EMPTY, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    spin_lock(&_spinlock);
+    if (__atomic_exchange_n(&sem->park, PARK_PARKED, __ATOMIC_ACQ_REL) ==
+        PARK_TOKEN) {
+        __atomic_store_n(&sem->park, PARK_EMPTY, __ATOMIC_RELAXED);
+        spin_unlock(&_spinlock);
+        return 0;
+    }
+    u_thread_block(cur_tcb, &sem->parked);
+
+    /* fiber_unpark() took the token along with waking this thread up, unless
+     * it was woken to act on its cancellation
+     */
+    token = PARK_PARKED;
+    __atomic_compare_exchange_n(&sem->park, &token, PARK_EMPTY, false,
+                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    if (u_thread_expired(cur_tcb))
+        u_thread_unwind(cur_tcb);
+
+    return 0;
+}
+
+/* hand a wake token to a thread, waking it up if it is parked */
+int fiber_unpark(fiber_t thread)
+{
+    sig_sem *sem = sigsem_of(thread);
+    if (!sem || !__atomic_load_n(&sem->used, __ATOMIC_ACQUIRE))
+        return -1;
+
+    /* only a parked thread needs the lock, to be taken off its wait list */
+    if (__atomic_exchange_n(&sem->park, PARK_TOKEN, __ATOMIC_ACQ_REL) !=
+        PARK_PARKED)
+        return 0;
+
+    bool woken = false;
+    spin_lock(&_spinlock);
+    _tcb *target = sem->thread;
+    if (target && target->wait_list == &sem->parked) {
+        __atomic_store_n(&sem->park, PARK_EMPTY, __ATOMIC_RELAXED);
+        u_thread_unblock(target);
+        woken = true;
+    }
+    spin_unlock(&_spinlock);
+
+    if (woken)
+        k_thread_wakeup(1);
+    return 0;
+}
+
+/* wait for thread termination */
+int fiber_join(fiber_t thread, void **value_ptr)
+{
+    sig_sem *sem = sigsem_of(thread);
+    if (!sem || !sem->used)
+        return -1;
+
+    /* a user-level thread blocks instead of its worker, which may be the one
+     * the joined thread is bound to
+     */
+    _tcb *cur_tcb = current_tcb();
+    while (cur_tcb) {
+        spin_lock(&_spinlock);
+        if (sem->exited) {
+            spin_unlock(&_spinlock);
+            break;
+        }
+        if (u_thread_expired(cur_tcb)) {
+            spin_unlock(&_spinlock);
+            u_thread_unwind(cur_tcb);
+        }
+        u_thread_block(cur_tcb, &sem->joiners);
+    }
+
+    /* do P() in thread semaphore until the certain user-level thread is done;
+     * a woken user-level thread only waits for the V() following its wakeup
+     */
+    while (cur_tcb && sem_trywait(&sem->semaphore))
+        fiber_yield();
+    while (!cur_tcb && -1 == sem_wait(&sem->semaphore) && EINTR == errno)
+        ;
+    /* get the value's location passed to fiber_exit */
+    if (value_ptr && sem->val)
+        memcpy((unsigned long *) *value_ptr, sem->val, sizeof(unsigned long));
+    fiber_free(sem->val);
+    sem->val = NULL;
+
+    /* the thread ID can be handed out again */
+    sem_destroy(&sem->semaphore);
+    bool canceled = sem->canceled;
+    sigsem_release(thread);
+    return canceled ? FIBER_CANCELED : 0;
+}
+
+/* terminate a thread */
+void fiber_exit(void *retval)
+{
+    _tcb *cur_tcb = current_tcb();
+    sig_sem *sem = sigsem_of(cur_tcb->tid);
+
+    /* run the cleanup handlers which are still pushed */
+    while (cur_tcb->cleanup)
+        fiber_cleanup_pop(1);
+
+    cur_tcb->status = TERMINATED;
+
+    if (retval) {
+        sem->val = fiber_alloc(sizeof(unsigned long));
+        memcpy(sem->val, retval, sizeof(unsigned long));
+    }
+    arena_release(cur_tcb);
+
+    /* When this thread finished, delete TCB and yield CPU control */
+    k_thread_switch(K_ACTION_RECLAIM);
+}
+
+/* request the cancellation of a thread */
+int fiber_cancel(fiber_t thread)
+{
+    _tcb *target = NULL;
+    bool woken = false;
+
+    sig_sem *sem = sigsem_of(thread);
+    if (!sem)
+        return -1;
+
+    spin_lock(&_spinlock);
+    target = sem->thread;
+    if (target) {
+        __atomic_store_n(&target->canceled, true, __ATOMIC_RELEASE);
+        /* a blocked thread acts on it as soon as it runs again */
+        if (target->wait_list) {
+            u_thread_unblock(target);
+            woken = true;
+        }
+    }
+    spin_unlock(&_spinlock);
+
+    if (woken)
+        k_thread_wakeup(1);
+    return target ? 0 : -1;
+}
+
+/* cancel a thread once the given time has elapsed */
+int fiber_set_deadline(fiber_t thread, unsigned long usec)
+{
+    _tcb *target = NULL;
+    uint64_t deadline = usec ? now_ns() + (uint64_t) usec * 1000 : 0;
+
+    sig_sem *sem = sigsem_of(thread);
+    if (!sem)
+        return -1;
+
+    spin_lock(&_spinlock);
+    target = sem->thread;
+    if (target) {
+        __atomic_store_n(&target->deadline, deadline, __ATOMIC_RELAXED);
+        if (deadline && deadline < next_deadline)
+            __atomic_store_n(&next_deadline, deadline, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&_spinlock);
+
+    if (!target)
+        return -1;
+
+    /* idle workers have to shorten their sleep */
+    __atomic_add_fetch(&k_thread_idle_seq, 1, __ATOMIC_SEQ_CST);
+    futex(&k_thread_idle_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    return 0;
+}
+
+/* choose when the calling thread acts on cancellation */
+int fiber_setcanceltype(int type, int *oldtype)
+{
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb ||
+        (FIBER_CANCEL_DEFERRED != type && FIBER_CANCEL_ASYNCHRONOUS != type))
+        return -1;
+
+    if (oldtype)
+        *oldtype = cur_tcb->cancel_type;
+    cur_tcb->cancel_type = type;
+    return 0;
+}
+
+/* cancellation point for threads which would not block otherwise */
+void fiber_testcancel()
+{
+    _tcb *cur_tcb = current_tcb();
+    if (cur_tcb && u_thread_expired(cur_tcb))
+        u_thread_unwind(cur_tcb);
+}
+
+/* push a handler to run when the calling thread is canceled or exits */
+int fiber_cleanup_push(void (*routine)(void *), void *arg)
+{
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb)
+        return -1;
+
+    struct _cleanup *cleanup = fiber_alloc(sizeof(struct _cleanup));
+    if (!cleanup)
+        return -1;
+    cleanup->routine = routine;
+    cleanup->arg = arg;
+    cleanup->next = cur_tcb->cleanup;
+    cur_tcb->cleanup = cleanup;
+    return 0;
+}
+
+/* pop the latest cleanup handler, running it if execute is non-zero */
+void fiber_cleanup_pop(int execute)
 {
-    __atomic_add_fetch(&preempt_disable_count, 1, __ATOMIC_ACQUIRE);
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb || !cur_tcb->cleanup)
+        return;
+
+    struct _cleanup *cleanup = cur_tcb->cleanup;
+    cur_tcb->cleanup = cleanup->next;
+    if (execute)
+        cleanup->routine(cleanup->arg);
+    fiber_free(cleanup);
 }
 
-static inline void preempt_enable()
+/* Structured task groups
+ *
+ * Tasks are run to completion by the workers without a TCB of their own, so
+ * fanning out costs a small block from the allocator instead of a stack.
+ * Spawning pushes onto the deque of the calling worker and returns at once;
+ * idle workers steal the oldest tasks from the other end. Waiting for a group
+ * first runs its queued tasks on the waiting thread, newest first, which keeps
+ * divide-and-conquer recursion on the worker which started it.
+ */
+
+/* whether any worker has a queued task, without taking the deque locks */
+static bool task_queued()
 {
-    __atomic_sub_fetch(&preempt_disable_count, 1, __ATOMIC_RELEASE);
+    for (int k = 0; k < thread_nums; k++) {
+        if (__atomic_load_n(&task_deque[k].next, __ATOMIC_SEQ_CST) !=
+            &task_deque[k])
+            return true;
+    }
+    return false;
 }
 
-static inline void spin_lock(uint *lock)
+/* queue a task on the calling worker, or on any worker from outside */
+static void task_push(_task *task)
 {
+    __atomic_add_fetch(&task->group->pending, 1, __ATOMIC_RELAXED);
+
     preempt_disable();
-    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
-        ;
+    int k = k_thread_self();
+    if (k < 0)
+        k = __atomic_fetch_add(&task_next, 1, __ATOMIC_RELAXED) % thread_nums;
+    spin_lock(&task_lock[k]);
+    enqueue(&task_deque[k], &task->node);
+    spin_unlock(&task_lock[k]);
+    preempt_enable();
+
+    k_thread_wakeup(1);
 }
 
-static inline void spin_unlock(uint *lock)
+/* take the newest task from the deque of worker k, of the given group only
+ * unless it is NULL
+ */
+static _task *task_pop(int k, fiber_group_t *group)
 {
-    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
-    preempt_enable();
+    list_node *q = &task_deque[k];
+    _task *task = NULL;
+
+    if (__atomic_load_n(&q->next, __ATOMIC_SEQ_CST) == q)
+        return NULL;
+
+    spin_lock(&task_lock[k]);
+    for (list_node *node = q->prev; node != q; node = node->prev) {
+        if (!group || GET_TASK(node)->group == group) {
+            task = GET_TASK(node);
+            list_remove(node);
+            break;
+        }
+    }
+    spin_unlock(&task_lock[k]);
+    return task;
 }
 
-static inline bool is_queue_empty(list_node *q)
+/* take the oldest task from the deque of another worker */
+static _task *task_steal(int k)
 {
-    return (bool) (q->prev == q) && (q->next == q);
+    for (int i = 1; i < thread_nums; i++) {
+        int victim = (k + i) % thread_nums;
+        list_node *node = NULL;
+        bool found;
+
+        if (__atomic_load_n(&task_deque[victim].next, __ATOMIC_SEQ_CST) ==
+            &task_deque[victim])
+            continue;
+        spin_lock(&task_lock[victim]);
+        found = dequeue(&task_deque[victim], &node);
+        spin_unlock(&task_lock[victim]);
+        if (found)
+            return GET_TASK(node);
+    }
+    return NULL;
 }
 
-static inline void enqueue(list_node *q, list_node *node)
+/* record the first failure of a group and cancel the rest of it */
+static void task_fail(fiber_group_t *group, int error)
 {
-    node->next = q;
-    q->prev->next = node;
-    node->prev = q->prev;
-    q->prev = node;
+    int expected = 0;
+    __atomic_compare_exchange_n(&group->error, &expected, error, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_store_n(&group->canceled, 1, __ATOMIC_RELEASE);
 }
 
-static inline bool dequeue(list_node *q, list_node **node)
+/* the last task of a group has finished, wake up whoever waits for it */
+static void task_done(fiber_group_t *group)
 {
-    if (is_queue_empty(q))
-        return false;
+    int woken = 0;
 
-    *node = q->next;
-    q->next = q->next->next;
-    q->next->prev = q;
+    /* the waiters return only after observing done under _spinlock, so the
+     * group, usually on their stack, is not touched after it is released.
+     */
+    spin_lock(&_spinlock);
+    __atomic_store_n(&group->done, 1, __ATOMIC_RELEASE);
+    while (!is_queue_empty(&group->wait_list)) {
+        u_thread_unblock(GET_TCB(group->wait_list.next));
+        woken++;
+    }
+    futex(&group->done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    spin_unlock(&_spinlock);
 
-    (*node)->next = (*node)->prev = NULL;
-    return true;
+    if (woken)
+        k_thread_wakeup(woken);
 }
 
-/* Fiber internals */
+/* run a task unless its group was canceled, then release it */
+static void task_run(_task *task)
+{
+    fiber_group_t *group = task->group;
 
-/* FIXME: avoid the use of global variables */
-static int thread_nums = 0;
+    if (!__atomic_load_n(&group->canceled, __ATOMIC_ACQUIRE)) {
+        int error = task->body ? task->body(task->lo, task->hi, task->arg)
+                               : task->func(task->arg);
+        if (error)
+            task_fail(group, error);
+    }
+    fiber_free(task);
 
-int fiber_init(int num)
-{
-    if (num <= 0)
-        return -1;
-    thread_nums = num; /* FIXME: validate the number of native threads */
-    return 0;
+    if (!__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL))
+        task_done(group);
 }
 
-void fiber_destroy()
+/* initialize a group of tasks */
+int fiber_group_init(fiber_group_t *group)
 {
-    /* FIXME: destroy allocated resources */
-    sleep(1);
-}
+    group->pending = 1; /* dropped by fiber_group_wait() */
+    group->error = 0;
+    group->canceled = 0;
+    group->done = 0;
 
-static int k_thread_exec_func(void *arg);
-static void u_thread_exec_func(void (*thread_func)(void *),
-                               void *arg,
-                               _tcb *thread);
+    (&(group->wait_list))->prev = &(group->wait_list);
+    (&(group->wait_list))->next = &(group->wait_list);
 
-/* create a new thread */
-int fiber_create(fiber_t *tid, void (*start_func)(void *), void *arg)
+    return 0;
+}
+
+/* queue a task in a group */
+int fiber_group_spawn(fiber_group_t *group, int (*func)(void *), void *arg)
 {
-    if (user_thread_num == U_THREAD_MAX) {
-        /* exceed ceiling limit of user lever threads */
-        perror("User level threads limit exceeded!");
+    if (!thread_nums || !func)
         return -1;
-    }
 
-    /* create a TCB for the new thread */
-    _tcb *thread = malloc(sizeof(_tcb) + 1 + _THREAD_STACK);
-    if (!thread) {
-        perror("Failed to allocate space for thread!");
+    _task *task = fiber_alloc(sizeof(_task));
+    if (!task)
         return -1;
-    }
+    task->group = group;
+    task->func = func;
+    task->body = NULL;
+    task->arg = arg;
+    task_push(task);
 
-    /* prepare for first user-level thread */
-    if (0 == user_thread_num) {
-        /* Initialize timeslice */
-        timeslice.it_value.tv_sec = 0;
-        timeslice.it_value.tv_usec = TIME_SLICE;
-        timeslice.it_interval.tv_sec = 0;
-        timeslice.it_interval.tv_usec = TIME_SLICE;
-
-        thread_queue->prev = thread_queue->next = thread_queue;
-
-        for (int i = 0; i < thread_nums; i++) {
-            /* allocate space for the newly created thread on stack */
-            void *stack = malloc(_THREAD_STACK);
-            if (!stack) {
-                perror("Failed to allocate space for stack!");
-                free(thread);
-                return -1;
-            }
+    return 0;
+}
 
-            /* invoke the clone system call to create a native thread */
-            if (-1 == clone(k_thread_exec_func, (char *) stack + _THREAD_STACK,
-                            SIGCHLD | CLONE_SIGHAND | CLONE_VM | CLONE_PTRACE,
-                            NULL)) {
-                perror("Failed to invoke clone system call.");
-                free(thread);
-                free(stack);
-                return -1;
-            }
+/* wait for every task of a group to finish */
+int fiber_group_wait(fiber_group_t *group)
+{
+    _tcb *cur_tcb = current_tcb();
+    _task *task = NULL;
+    int error;
+
+    if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL)) {
+        /* run what nobody has stolen yet */
+        while (!__atomic_load_n(&group->done, __ATOMIC_ACQUIRE)) {
+            preempt_disable();
+            int k = k_thread_self();
+            preempt_enable();
+            if (k < 0 || !(task = task_pop(k, group)))
+                break;
+            task_run(task);
         }
-    }
-
-    /* set thread id and level */
-    thread->tid = user_thread_num++;
-    *tid = thread->tid;
-
-    /* set initial priority to be the highest */
-    thread->prio = 0;
 
-    /* set node in thread run queue */
-    thread->node.next = thread->node.prev = NULL;
+        if (!cur_tcb) {
+            /* neither tasks nor native threads can switch out */
+            while (!__atomic_load_n(&group->done, __ATOMIC_ACQUIRE))
+                futex(&group->done, FUTEX_WAIT_PRIVATE, 0, NULL);
+            spin_lock(&_spinlock);
+            spin_unlock(&_spinlock);
+        }
 
-    /* initialize sigsem_thread */
-    sigsem_thread[thread->tid].val = NULL;
-    sem_init(&(sigsem_thread[thread->tid].semaphore), 0, 0);
+        while (cur_tcb) {
+            spin_lock(&_spinlock);
+            if (__atomic_load_n(&group->done, __ATOMIC_ACQUIRE)) {
+                spin_unlock(&_spinlock);
+                break;
+            }
 
-    /* create a context for this user-level thread */
-    if (-1 == getcontext(&thread->context)) {
-        perror("Failed to get uesr context!");
-        return -1;
+            /* a canceled thread still waits, but the rest of its group is
+             * dropped; it unwinds once no task refers to the group anymore.
+             */
+            if (u_thread_expired(cur_tcb))
+                __atomic_store_n(&group->canceled, 1, __ATOMIC_RELEASE);
+            u_thread_block(cur_tcb, &group->wait_list);
+        }
     }
 
-    /* set the context to a newly allocated stack */
-    thread->context.uc_link = &context_main[0];
-    thread->context.uc_stack.ss_sp = thread->stack;
-    thread->context.uc_stack.ss_size = _THREAD_STACK;
-    thread->context.uc_stack.ss_flags = 0;
-
-    /* set the context, which calls a wrapper function and then start_func */
-    makecontext(&thread->context, (void (*)(void)) & u_thread_exec_func, 3,
-                start_func, arg, thread);
-
-    /* add newly created thread to the user-level thread run queue */
-    spin_lock(&_spinlock);
-
-    enqueue(thread_queue + thread->prio, &thread->node);
-    spin_unlock(&_spinlock);
+    error = group->error;
+    fiber_group_init(group);
+    if (cur_tcb && u_thread_expired(cur_tcb))
+        u_thread_unwind(cur_tcb);
 
-    return 0;
+    return error;
 }
 
-/* give CPU pocession to other user-level threads voluntarily */
-int fiber_yield()
+/* drop the tasks of a group which have not started yet */
+void fiber_group_cancel(fiber_group_t *group)
 {
-    uint k_tid = (uint) syscall(SYS_gettid);
-    _tcb *cur_tcb = GET_TCB(cur_thread_node[k_tid & K_CONTEXT_MASK]);
-    spin_lock(&_spinlock);
-
-    if (RUNNING == cur_tcb->status) {
-        cur_tcb->status = SUSPENDED;
-        enqueue(thread_queue + cur_tcb->prio,
-                cur_thread_node[k_tid & K_CONTEXT_MASK]);
-        spin_unlock(&_spinlock);
-
-        swapcontext(&(cur_tcb->context), &context_main[k_tid & K_CONTEXT_MASK]);
-    } else
-        spin_unlock(&_spinlock);
-    return 0;
+    __atomic_store_n(&group->canceled, 1, __ATOMIC_RELEASE);
 }
 
-/* wait for thread termination */
-int fiber_join(fiber_t thread, void **value_ptr)
+/* whether a group was canceled */
+int fiber_group_canceled(fiber_group_t *group)
 {
-    /* do P() in thread semaphore until the certain user-level thread is done */
-    sem_wait(&(sigsem_thread[thread].semaphore));
-    /* get the value's location passed to fiber_exit */
-    if (value_ptr && sigsem_thread[thread].val)
-        memcpy((unsigned long *) *value_ptr, sigsem_thread[thread].val,
-               sizeof(unsigned long));
-    return 0;
+    return __atomic_load_n(&group->canceled, __ATOMIC_ACQUIRE);
 }
 
-/* terminate a thread */
-void fiber_exit(void *retval)
+/* run a loop body over a range, split into tasks of grain indices each */
+int fiber_parallel_for(size_t begin,
+                       size_t end,
+                       size_t grain,
+                       int (*body)(size_t, size_t, void *),
+                       void *arg)
 {
-    uint k_tid = (uint) syscall(SYS_gettid);
-    _tcb *cur_tcb = GET_TCB(cur_thread_node[k_tid & K_CONTEXT_MASK]);
-    fiber_t currefiber_id = cur_tcb->tid;
+    fiber_group_t *group;
+    int cleanup, error;
 
-    cur_tcb->status = TERMINATED;
-    /* When this thread finished, delete TCB and yield CPU control */
-    user_thread_num--;
+    if (!thread_nums || !body)
+        return -1;
 
-    sigsem_thread[currefiber_id].val = malloc(sizeof(unsigned long));
-    memcpy(sigsem_thread[currefiber_id].val, retval, sizeof(unsigned long));
+    /* a few chunks per worker leave room for balancing the load */
+    if (!grain)
+        grain = (end - begin) / (thread_nums * 4);
+    if (!grain)
+        grain = 1;
 
-    spin_lock(&_spinlock);
-    enqueue(thread_queue + cur_tcb->prio,
-            cur_thread_node[k_tid & K_CONTEXT_MASK]);
-    spin_unlock(&_spinlock);
+    /* tasks keep updating the group while the caller waits, so it cannot
+     * live on a shared stack, which is copied out whenever the caller is
+     * switched out. A cleanup handler frees it if the wait unwinds.
+     */
+    if (!(group = fiber_alloc(sizeof(fiber_group_t))))
+        return -1;
+    cleanup = !fiber_cleanup_push(fiber_free, group);
+    fiber_group_init(group);
+    for (size_t lo = begin; lo < end; lo += grain) {
+        _task *task = fiber_alloc(sizeof(_task));
+        if (!task) {
+            task_fail(group, -1);
+            break;
+        }
+        task->group = group;
+        task->func = NULL;
+        task->body = body;
+        task->lo = lo;
+        task->hi = end - lo > grain ? lo + grain : end;
+        task->arg = arg;
+        task_push(task);
+    }
 
-    swapcontext(&(cur_tcb->context), &context_main[k_tid & K_CONTEXT_MASK]);
+    error = fiber_group_wait(group);
+    if (cleanup)
+        fiber_cleanup_pop(1);
+    else
+        fiber_free(group);
+    return error;
 }
 
 /* schedule the user-level threads */
 static void schedule()
 {
-    uint k_tid = (uint) syscall(SYS_gettid);
-    _tcb *cur_tcb = GET_TCB(cur_thread_node[k_tid & K_CONTEXT_MASK]);
+    if (preempt_disabled())
+        return;
 
-    if (preempt_disable_count)
+    /* the worker itself is not preemptible */
+    int k = k_thread_self();
+    if (k < 0 || !cur_thread_node[k])
         return;
 
-    spin_lock(&_spinlock);
-    cur_tcb->status = SUSPENDED;
-    enqueue(thread_queue + cur_tcb->prio,
-            cur_thread_node[k_tid & K_CONTEXT_MASK]);
-    spin_unlock(&_spinlock);
+    /* asynchronous cancellation takes effect at any preemption */
+    _tcb *cur_tcb = GET_TCB(cur_thread_node[k]);
+    if (FIBER_CANCEL_ASYNCHRONOUS == cur_tcb->cancel_type &&
+        u_thread_expired(cur_tcb))
+        u_thread_unwind(cur_tcb);
 
-    swapcontext(&(cur_tcb->context), &context_main[k_tid & K_CONTEXT_MASK]);
+    cur_tcb->status = SUSPENDED;
+    k_thread_switch(K_ACTION_READY);
 }
 
 /* start user-level thread wrapper function */
@@ -305,29 +2480,59 @@ static void u_thread_exec_func(void (*thread_func)(void *),
                                void *arg,
                                _tcb *thread)
 {
-    uint k_tid = 0;
     _tcb *u_thread = thread;
 
-    thread_func(arg);
-    u_thread->status = FINISHED;
+    /* disabled by the worker which started this thread */
+    preempt_enable();
 
-    k_tid = (uint) syscall(SYS_gettid);
+    /* canceled, or expired, before it even started */
+    if (u_thread_expired(u_thread))
+        u_thread_unwind(u_thread);
 
-    u_thread->context.uc_link = &context_main[k_tid & K_CONTEXT_MASK];
+    thread_func(arg);
+    while (u_thread->cleanup)
+        fiber_cleanup_pop(1);
+    arena_release(u_thread);
+    u_thread->status = FINISHED;
 
     /* When this thread finished, delete TCB and yield CPU control */
-    spin_lock(&_spinlock);
-    enqueue(thread_queue + u_thread->prio,
-            cur_thread_node[k_tid & K_CONTEXT_MASK]);
-    spin_unlock(&_spinlock);
+    k_thread_switch(K_ACTION_RECLAIM);
+}
 
-    swapcontext(&u_thread->context, &context_main[k_tid & K_CONTEXT_MASK]);
+/* move a shared-stack thread onto the shared stack of worker k, saving the
+ * used part of it for the thread which was there before; false if that one
+ * found no memory to be saved to when it switched out
+ */
+static bool k_thread_stack_in(int k, _tcb *thread)
+{
+    char *top = k_shared_stack[k] + SHARED_STACK;
+    _tcb *owner = k_shared_owner[k];
+
+    /* nothing else ran on the stack since the thread switched out */
+    if (owner == thread)
+        return true;
+
+    if (owner) {
+        size_t used = top - owner->stack_sp;
+        if (used > owner->saved_size)
+            return false;
+        memcpy(owner->saved, owner->stack_sp, used);
+    }
+
+    if (NOT_STARTED == thread->status)
+        makecontext(&thread->context, (void (*)(void)) & u_thread_exec_func, 3,
+                    thread->start_func, thread->start_arg, thread);
+    else
+        memcpy(thread->stack_sp, thread->saved, top - thread->stack_sp);
+    k_shared_owner[k] = thread;
+    return true;
 }
 
 /* run native thread (or kernel-level thread) function */
-static int k_thread_exec_func(void *arg UNUSED)
+static void *k_thread_exec_func(void *arg)
 {
-    uint k_tid = (uint) syscall(SYS_gettid);
+    int k = (int) (intptr_t) arg;
+    k_thread_id = k;
 
     list_node *run_node = NULL;
     _tcb *run_tcb = NULL;
@@ -338,42 +2543,266 @@ static int k_thread_exec_func(void *arg UNUSED)
     };
     sigaction(SIGPROF, &sched_handler, NULL);
 
-    setitimer(ITIMER_PROF, &timeslice, NULL);
+    /* the time slice counts the CPU time of this worker alone */
+    struct sigevent sev = {
+        .sigev_notify = SIGEV_THREAD_ID,
+        .sigev_signo = SIGPROF,
+    };
+    sev._sigev_un._tid = (pid_t) syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &k_thread_timer[k])) {
+        perror("Failed to create the time slice timer!");
+        abort();
+    }
+    timer_settime(k_thread_timer[k], 0, &timeslice, NULL);
+
+    /* handoffs left in the slot are kicked over in wall-clock time */
+    struct sigaction kick_handler = {
+        .sa_handler = &k_thread_kick,
+        .sa_flags = SA_RESTART,
+    };
+    sigemptyset(&kick_handler.sa_mask);
+    sigaddset(&kick_handler.sa_mask, SIGPROF); /* never switch away in it */
+    sigaction(SIGURG, &kick_handler, NULL);
+    sev.sigev_signo = SIGURG;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &k_thread_kick_timer[k])) {
+        perror("Failed to create the kick timer!");
+        abort();
+    }
+    __atomic_store_n(&k_thread_kick_armed[k], false, __ATOMIC_SEQ_CST);
 
     /* obtain and run a user-level thread from the user-level thread queue,
-     * until no available user-level thread
+     * until the runtime is shut down and no user-level thread is runnable
      */
     while (1) {
-        spin_lock(&_spinlock);
-
-        if (!dequeue(thread_queue, &run_node)) {
+        bool found = false;
+        bool canceled = false;
+        bool quit = false;
+
+        if (__atomic_load_n(&next_deadline, __ATOMIC_RELAXED) != UINT64_MAX)
+            k_thread_expire();
+
+        /* threads which keep running past the drain get canceled as well */
+        uint64_t drain_due =
+            __atomic_load_n(&k_thread_drain_due, __ATOMIC_SEQ_CST);
+        if (drain_due != UINT64_MAX &&
+            !__atomic_load_n(&k_thread_cancel_all, __ATOMIC_SEQ_CST) &&
+            now_ns() >= drain_due) {
+            int woken = 0;
+            spin_lock(&_spinlock);
+            if (!k_thread_cancel_all) {
+                k_thread_cancel_all = true;
+                woken = k_thread_cancel_remaining();
+            }
             spin_unlock(&_spinlock);
+            if (woken)
+                k_thread_wakeup(woken);
+        }
 
-            setitimer(ITIMER_PROF, &zero_timer, &timeslice);
-            return 0;
+        /* EDF threads first, the earliest deadline of all workers; count as
+         * busy before taking one, so that shutdown does not miss it.
+         */
+        if (edf_queued(k)) {
+            __atomic_add_fetch(&k_thread_busy, 1, __ATOMIC_SEQ_CST);
+            _tcb *thread = edf_pop(k);
+            if (thread) {
+                run_node = &thread->node;
+                found = true;
+            } else
+                __atomic_sub_fetch(&k_thread_busy, 1, __ATOMIC_SEQ_CST);
         }
-        spin_unlock(&_spinlock);
 
-        run_tcb = GET_TCB(run_node);
+        /* then tasks, some thread is waiting for them to finish */
+        if (!found && task_queued()) {
+            __atomic_add_fetch(&k_thread_busy, 1, __ATOMIC_SEQ_CST);
+            _task *task = task_pop(k, NULL);
+            if (!task)
+                task = task_steal(k);
+            if (task)
+                task_run(task);
+            __atomic_sub_fetch(&k_thread_busy, 1, __ATOMIC_SEQ_CST);
+            if (task)
+                continue;
+        }
 
-        /* current user thread is already terminated or finished by
-         * fiber_exit()
-         */
-        if (TERMINATED == run_tcb->status || FINISHED == run_tcb->status) {
-            /* do V() in thread semaphore implies that current user-level
-             * thread is done.
+        if (!found) {
+            spin_lock(&_spinlock);
+
+            /* a thread woken up here runs right after its waker, unless the
+             * handoffs went on for so long that the run queues are due, or a
+             * thread of a higher priority got queued since
+             */
+            _tcb *next = k_thread_next[k];
+            if (next) {
+                __atomic_store_n(&k_thread_next[k], NULL, __ATOMIC_SEQ_CST);
+                if (k_thread_handoffs[k]++ < RUNNEXT_MAX &&
+                    !u_thread_outranked(next->prio)) {
+                    run_node = &next->node;
+                    found = true;
+                } else
+                    enqueue(thread_queue + next->prio, &next->node);
+            }
+            if (!found) {
+                k_thread_handoffs[k] = 0;
+                k_thread_turn[k] = !k_thread_turn[k];
+                if (k_thread_turn[k])
+                    found = dequeue(&k_thread_queue[k], &run_node);
+            }
+            for (int i = 0; i < PRIORITY && !found; i++)
+                found = dequeue(thread_queue + i, &run_node);
+            if (!found)
+                found = dequeue(&k_thread_queue[k], &run_node);
+            if (!found)
+                found = k_thread_steal_next(k, &run_node);
+            if (found)
+                __atomic_add_fetch(&k_thread_busy, 1, __ATOMIC_SEQ_CST);
+            else if (__atomic_load_n(&k_thread_shutdown, __ATOMIC_SEQ_CST) &&
+                     !__atomic_load_n(&k_thread_busy, __ATOMIC_SEQ_CST) &&
+                     !edf_queued(-1) && !k_thread_bound_queued(false) &&
+                     !k_thread_next_queued(false)) {
+                if (!k_thread_cancel_all) {
+                    /* nothing can run anymore, unwind the blocked threads */
+                    k_thread_cancel_all = true;
+                    canceled = k_thread_cancel_remaining() > 0;
+                } else
+                    quit = true;
+            }
+            spin_unlock(&_spinlock);
+        }
+
+        if (!found) {
+            if (canceled)
+                continue;
+            if (quit)
+                break;
+
+            /* stay until every worker is done, some threads may be bound to
+             * this one
              */
-            sem_post(&(sigsem_thread[run_tcb->tid].semaphore));
-            free(run_tcb);
-            user_thread_num--;
+            if (__atomic_load_n(&k_thread_shutdown, __ATOMIC_SEQ_CST))
+                sched_yield();
+            else
+                k_thread_idle_wait(k);
             continue;
         }
 
+        run_tcb = GET_TCB(run_node);
+        if (run_tcb->shared && !k_thread_stack_in(k, run_tcb)) {
+            /* wait for memory, or for the thread holding the stack to run */
+            spin_lock(&_spinlock);
+            u_thread_ready(run_tcb);
+            spin_unlock(&_spinlock);
+            __atomic_sub_fetch(&k_thread_busy, 1, __ATOMIC_SEQ_CST);
+            sched_yield();
+            continue;
+        }
         run_tcb->status = RUNNING;
-        cur_thread_node[k_tid & K_CONTEXT_MASK] = run_node;
-        swapcontext(&context_main[k_tid & K_CONTEXT_MASK], &(run_tcb->context));
+        run_tcb->k_last = k;
+
+        /* a timer signal before the switch completes would otherwise save the
+         * frames of the worker as the context of the thread; re-enabled by the
+         * thread once it runs
+         */
+        preempt_disable();
+        cur_thread_node[k] = run_node;
+        __atomic_store_n(&k_thread_due[k],
+                         EDF == run_tcb->policy ? run_tcb->edf_due : UINT64_MAX,
+                         __ATOMIC_SEQ_CST);
+        swapcontext(&context_main[k], &(run_tcb->context));
+        __atomic_store_n(&k_thread_due[k], 0, __ATOMIC_SEQ_CST);
+        cur_thread_node[k] = NULL;
+
+        /* the thread disabled preemption before switching out */
+        preempt_enable();
+
+        switch (k_thread_action[k]) {
+        case K_ACTION_READY: {
+            spin_lock(&_spinlock);
+            int bound = run_tcb->k_bound;
+            u_thread_ready(run_tcb);
+            spin_unlock(&_spinlock);
+
+            /* pinned to another worker meanwhile */
+            if (bound >= 0 && bound != k)
+                k_thread_wakeup(1);
+            break;
+        }
+        case K_ACTION_RECLAIM:
+            u_thread_reclaim(run_tcb);
+            break;
+        case K_ACTION_UNLOCK:
+            spin_unlock(&_spinlock);
+            break;
+        default:
+            break;
+        }
+
+        __atomic_sub_fetch(&k_thread_busy, 1, __ATOMIC_SEQ_CST);
+    }
+
+    timer_delete(k_thread_timer[k]);
+    __atomic_store_n(&k_thread_kick_armed[k], true, __ATOMIC_SEQ_CST);
+    timer_delete(k_thread_kick_timer[k]);
+    return NULL;
+}
+
+/* first thread of the highest priority on a wait list, with _spinlock held */
+static _tcb *u_thread_best(list_node *wait_list)
+{
+    _tcb *best = NULL;
+
+    for (list_node *node = wait_list->next; node != wait_list;
+         node = node->next) {
+        _tcb *thread = GET_TCB(node);
+        if (!best || thread->prio < best->prio)
+            best = thread;
+    }
+    return best;
+}
+
+/* change the effective priority of a thread, with _spinlock held, moving it
+ * to the matching run queue if it waits on one
+ */
+static void u_thread_set_prio(_tcb *thread, uint prio)
+{
+    bool queued = EDF != thread->policy && thread->k_bound < 0 &&
+                  !thread->wait_list && thread->node.next;
+
+    if (queued)
+        list_remove(&thread->node);
+    thread->prio = prio;
+    if (queued)
+        enqueue(thread_queue + prio, &thread->node);
+}
+
+/* recompute the effective priority of the calling thread from its own one and
+ * the waiters of the mutexes it holds, with _spinlock held
+ */
+static void u_thread_inherit(_tcb *thread)
+{
+    uint prio = thread->base_prio;
+
+    for (list_node *node = thread->held.next; node != &thread->held;
+         node = node->next) {
+        _tcb *waiter = u_thread_best(&GET_MUTEX(node)->wait_list);
+        if (waiter && waiter->prio < prio)
+            prio = waiter->prio;
+    }
+    thread->prio = prio;
+}
+
+/* lend a priority to the owner of a mutex, and on along the chain of mutexes
+ * the owners block on, with _spinlock held
+ */
+static void mutex_boost(fiber_mutex_t *mutex, uint prio)
+{
+    /* a priority only ever rises here, so a cycle cannot go on forever */
+    while (mutex) {
+        _tcb *owner = __atomic_load_n(&mutex->owner, __ATOMIC_SEQ_CST);
+        if (!owner || owner->prio <= prio)
+            break;
+        u_thread_set_prio(owner, prio);
+        mutex = owner->waiting_on;
     }
-    return 0;
 }
 
 /* initialize the mutex lock */
@@ -381,6 +2810,7 @@ int fiber_mutex_init(fiber_mutex_t *mutex)
 {
     mutex->owner = NULL;
     mutex->lock = 0;
+    mutex->held.next = mutex->held.prev = NULL;
 
     (&(mutex->wait_list))->prev = &(mutex->wait_list);
     (&(mutex->wait_list))->next = &(mutex->wait_list);
@@ -388,52 +2818,130 @@ int fiber_mutex_init(fiber_mutex_t *mutex)
     return 0;
 }
 
-/* acquire the mutex lock */
-int fiber_mutex_lock(fiber_mutex_t *mutex)
+/* acquire the mutex lock, possibly acting on cancellation while blocked */
+static int mutex_acquire(fiber_mutex_t *mutex, bool cancelable)
 {
-    uint k_tid = (uint) syscall(SYS_gettid);
+    _tcb *cur_tcb = current_tcb();
 
     /* avoid recursive locks */
-    if (unlikely(mutex->owner ==
-                 GET_TCB(cur_thread_node[k_tid & K_CONTEXT_MASK])))
+    if (unlikely(cur_tcb && mutex->owner == cur_tcb))
         return -1;
 
     /* Use "test-and-set" atomic operation to acquire the mutex lock */
     while (__atomic_test_and_set(&mutex->lock, __ATOMIC_ACQUIRE)) {
-        enqueue(&mutex->wait_list, cur_thread_node[k_tid & K_CONTEXT_MASK]);
-        swapcontext(
-            &(GET_TCB(cur_thread_node[k_tid & K_CONTEXT_MASK])->context),
-            &context_main[k_tid & K_CONTEXT_MASK]);
+        /* not a user-level thread, there is nothing to block */
+        if (!cur_tcb) {
+            sched_yield();
+            continue;
+        }
+
+        spin_lock(&_spinlock);
+        if (cancelable && u_thread_expired(cur_tcb)) {
+            spin_unlock(&_spinlock);
+            u_thread_unwind(cur_tcb);
+        }
+
+        /* queue up before retrying: either the lock is free by now, or the
+         * owner finds this thread on the wait list when releasing it.
+         */
+        enqueue(&mutex->wait_list, &cur_tcb->node);
+        cur_tcb->wait_list = &mutex->wait_list;
+        cur_tcb->waiting_on = mutex;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_test_and_set(&mutex->lock, __ATOMIC_ACQUIRE)) {
+            list_remove(&cur_tcb->node);
+            cur_tcb->wait_list = NULL;
+            cur_tcb->waiting_on = NULL;
+            spin_unlock(&_spinlock);
+            break;
+        }
+
+        /* an owner not known yet looks at the wait list itself */
+        mutex_boost(mutex, cur_tcb->prio);
+        k_thread_switch(K_ACTION_UNLOCK);
+    }
+    __atomic_store_n(&mutex->owner, cur_tcb, __ATOMIC_SEQ_CST);
+
+    if (cur_tcb) {
+        enqueue(&cur_tcb->held, &mutex->held);
+
+        /* inherit from the threads which queued up before */
+        if (__atomic_load_n(&mutex->wait_list.next, __ATOMIC_SEQ_CST) !=
+            &mutex->wait_list) {
+            spin_lock(&_spinlock);
+            u_thread_inherit(cur_tcb);
+            spin_unlock(&_spinlock);
+        }
     }
-    mutex->owner = GET_TCB(cur_thread_node[k_tid & K_CONTEXT_MASK]);
 
     return 0;
 }
 
+/* hand a mutex over by its owner, if a user-level thread, which gets back
+ * what it inherited through it
+ */
+static void mutex_release(fiber_mutex_t *mutex, _tcb *owner)
+{
+    if (owner)
+        list_remove(&mutex->held);
+    __atomic_store_n(&mutex->owner, NULL, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&mutex->lock, 0, __ATOMIC_SEQ_CST);
+}
+
+/* wake up the first waiter of the highest priority of a released mutex, with
+ * _spinlock held
+ */
+static bool mutex_wake(fiber_mutex_t *mutex)
+{
+    _tcb *waiter = u_thread_best(&mutex->wait_list);
+    if (!waiter)
+        return false;
+
+    u_thread_unblock(waiter);
+    return true;
+}
+
+/* acquire the mutex lock */
+int fiber_mutex_lock(fiber_mutex_t *mutex)
+{
+    return mutex_acquire(mutex, true);
+}
+
 /* release the mutex lock */
 int fiber_mutex_unlock(fiber_mutex_t *mutex)
 {
-    list_node *next_node = NULL;
-    _tcb *cur_tcb = NULL;
-    if (!dequeue(&(mutex->wait_list), &next_node)) {
-        __atomic_store_n(&mutex->lock, 0, __ATOMIC_RELEASE);
-        mutex->owner = NULL;
+    bool woken = false;
+    _tcb *owner = mutex->owner;
+
+    mutex_release(mutex, owner);
+
+    /* pairs with the fence in mutex_acquire(), a waiter which boosted the
+     * owner is on the wait list by now
+     */
+    if (__atomic_load_n(&mutex->wait_list.next, __ATOMIC_SEQ_CST) ==
+            &mutex->wait_list &&
+        (!owner || owner->prio == owner->base_prio))
         return 0;
-    }
-    cur_tcb = GET_TCB(next_node);
-    cur_tcb->prio = 0;
+
     spin_lock(&_spinlock);
-    enqueue(thread_queue + cur_tcb->prio, next_node);
+    woken = mutex_wake(mutex);
+    if (owner)
+        u_thread_inherit(owner);
     spin_unlock(&_spinlock);
-    __atomic_store_n(&mutex->lock, 0, __ATOMIC_RELEASE);
-    mutex->owner = NULL;
+
+    if (woken)
+        k_thread_wakeup(1);
     return 0;
 }
 
 /* destory the mutex lock */
-int fiber_mutex_destroy(fiber_mutex_t *mutex UNUSED)
+int fiber_mutex_destroy(fiber_mutex_t *mutex)
 {
-    /* FIXME: deallocate */
+    /* refuse to destroy a mutex which is held or waited for */
+    if (mutex->lock || !is_queue_empty(&mutex->wait_list))
+        return -1;
+
+    mutex->owner = NULL;
     return 0;
 }
 
@@ -449,55 +2957,77 @@ int fiber_cond_init(fiber_cond_t *condvar)
 /* wake up all threads on waiting list of condition variable */
 int fiber_cond_broadcast(fiber_cond_t *condvar)
 {
-    list_node *next_node = NULL;
     _tcb *cur_tcb = NULL;
-    while (!dequeue(&(condvar->wait_list), &next_node)) {
-        cur_tcb = GET_TCB(next_node);
-        cur_tcb->prio = 0;
-        while (__atomic_test_and_set(&_spinlock, __ATOMIC_ACQUIRE))
-            ;
-        enqueue(thread_queue + cur_tcb->prio, next_node);
-        __atomic_store_n(&_spinlock, 0, __ATOMIC_RELEASE);
+    int woken = 0;
+
+    spin_lock(&_spinlock);
+    while (!is_queue_empty(&condvar->wait_list)) {
+        cur_tcb = GET_TCB(condvar->wait_list.next);
+        u_thread_unblock(cur_tcb);
+        woken++;
     }
+    spin_unlock(&_spinlock);
+
+    if (woken)
+        k_thread_wakeup(woken);
     return 0;
 }
 
 /* wake up a thread on waiting list of condition variable */
 int fiber_cond_signal(fiber_cond_t *condvar)
 {
-    list_node *next_node = NULL;
     _tcb *cur_tcb = NULL;
-    if (!dequeue(&(condvar->wait_list), &next_node))
-        return 0;
 
-    cur_tcb = GET_TCB(next_node);
-    cur_tcb->prio = 0;
     spin_lock(&_spinlock);
-    enqueue(thread_queue + cur_tcb->prio, next_node);
+    cur_tcb = u_thread_best(&condvar->wait_list);
+    if (!cur_tcb) {
+        spin_unlock(&_spinlock);
+        return 0;
+    }
+    u_thread_unblock(cur_tcb);
     spin_unlock(&_spinlock);
 
+    k_thread_wakeup(1);
     return 0;
 }
 
 /* current thread go to sleep until other thread wakes it up */
 int fiber_cond_wait(fiber_cond_t *condvar, fiber_mutex_t *mutex)
 {
-    uint k_tid = (uint) syscall(SYS_gettid);
+    _tcb *cur_tcb = current_tcb();
+    if (!cur_tcb)
+        return -1;
 
-    list_node *node = cur_thread_node[k_tid & K_CONTEXT_MASK];
-    enqueue(&condvar->wait_list, node);
+    spin_lock(&_spinlock);
+    if (u_thread_expired(cur_tcb)) {
+        spin_unlock(&_spinlock);
+        u_thread_unwind(cur_tcb);
+    }
 
-    fiber_mutex_unlock(mutex);
-    swapcontext(&(GET_TCB(cur_thread_node[k_tid & K_CONTEXT_MASK])->context),
-                &context_main[k_tid & K_CONTEXT_MASK]);
-    fiber_mutex_lock(mutex);
+    /* release the mutex without dropping _spinlock, so that no signal can
+     * slip in before this thread has switched out.
+     */
+    mutex_release(mutex, mutex->owner);
+    bool woken = mutex_wake(mutex);
+    u_thread_inherit(cur_tcb);
+    if (woken)
+        k_thread_wakeup(1);
+    u_thread_block(cur_tcb, &condvar->wait_list);
+
+    /* like pthreads, hold the mutex again when cleanup handlers run */
+    mutex_acquire(mutex, false);
+    if (u_thread_expired(cur_tcb))
+        u_thread_unwind(cur_tcb);
 
     return 0;
 }
 
 /* destory condition variable */
-int fiber_cond_destroy(fiber_cond_t *condvar UNUSED)
+int fiber_cond_destroy(fiber_cond_t *condvar)
 {
-    /* FIXME: deallocate */
+    /* refuse to destroy a condition variable somebody still waits on */
+    if (!is_queue_empty(&condvar->wait_list))
+        return -1;
+
     return 0;
 }
@@ -0,0 +1,125 @@
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fiber.h"
+
+#define N_ROUNDS 20000
+#define WORKING_SET (16 * 1024) /* data each player touches per turn */
+
+static fiber_mutex_t mutex;
+static fiber_cond_t cond;
+static int turn = 0, go = 0;
+static long migrations = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* cache misses of this process and the workers it creates afterwards, -1 if
+ * the counter is not available
+ */
+static int misses_open()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void player(void *data)
+{
+    int me = (int) (intptr_t) data;
+    char *set = fiber_alloc(WORKING_SET);
+    int last = -1;
+
+    memset(set, me, WORKING_SET);
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        fiber_yield();
+    fiber_yield();
+
+    for (int i = 0; i < N_ROUNDS; ++i) {
+        fiber_mutex_lock(&mutex);
+        while (turn != me)
+            fiber_cond_wait(&cond, &mutex);
+        int k = fiber_worker();
+        if (last >= 0 && k != last)
+            migrations++;
+        last = k;
+        for (int j = 0; j < WORKING_SET; j += 64)
+            set[j]++;
+        turn = !me;
+        fiber_cond_signal(&cond);
+        fiber_mutex_unlock(&mutex);
+    }
+    fiber_free(set);
+}
+
+/* pin: worker of each player, -1 for the default wake-affine placement */
+static void run(const char *name, int pin0, int pin1)
+{
+    fiber_t thread[2];
+
+    int fd = misses_open();
+    fiber_init(2);
+    fiber_mutex_init(&mutex);
+    fiber_cond_init(&cond);
+
+    turn = go = 0;
+    migrations = 0;
+    fiber_create(&thread[0], &player, (void *) 0);
+    fiber_create(&thread[1], &player, (void *) 1);
+    fiber_pin(thread[0], pin0);
+    fiber_pin(thread[1], pin1);
+
+    if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    uint64_t start = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    fiber_join(thread[0], NULL);
+    fiber_join(thread[1], NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    long long misses = -1;
+    if (fd >= 0) {
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = -1;
+        close(fd);
+    }
+    fiber_destroy();
+
+    printf("%-16s round trip %8.1f ns, %6.2f%% migrations", name,
+           (double) elapsed / N_ROUNDS,
+           100.0 * migrations / (2.0 * (N_ROUNDS - 1)));
+    if (misses >= 0)
+        printf(", %6.1f cache misses per round trip\n",
+               (double) misses / N_ROUNDS);
+    else
+        printf(", cache misses n/a\n");
+}
+
+int main()
+{
+    printf(
+        "ping-pong of two fibers through a mutex and a condition variable "
+        "on 2 workers\n");
+    run("wake-affine", -1, -1);
+    run("pinned together", 0, 0);
+    run("pinned apart", 0, 1);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fiber.h"
+
+#define N_WORKERS 2
+#define N_BACKGROUND 4
+#define N_REQUESTS 40
+
+static volatile int stop = 0;
+static uint64_t started[N_REQUESTS];
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* CPU-bound fiber keeping every worker busy */
+static void background(void *data)
+{
+    (void) data;
+    while (!stop)
+        ;
+}
+
+static void request(void *data)
+{
+    started[(intptr_t) data] = now_ns();
+}
+
+static int compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* latency from creating a request fiber until it starts to run */
+static void run(const char *name, int policy)
+{
+    uint64_t latency[N_REQUESTS];
+    fiber_t bg[N_BACKGROUND], thread;
+    fiber_attr_t attr;
+
+    fiber_attr_init(&attr);
+    fiber_attr_setschedpolicy(&attr, policy);
+    fiber_attr_setdeadline(&attr, 1000);
+
+    stop = 0;
+    for (int i = 0; i < N_BACKGROUND; ++i)
+        fiber_create(&bg[i], &background, NULL);
+    usleep(10000);
+
+    for (int i = 0; i < N_REQUESTS; ++i) {
+        uint64_t created = now_ns();
+        fiber_create_attr(&thread, &attr, &request, (void *) (intptr_t) i);
+        fiber_join(thread, NULL);
+        latency[i] = started[i] - created;
+    }
+
+    stop = 1;
+    for (int i = 0; i < N_BACKGROUND; ++i)
+        fiber_join(bg[i], NULL);
+
+    qsort(latency, N_REQUESTS, sizeof(uint64_t), compare);
+    printf("%-4s p50 %10.1f us  p99 %10.1f us  max %10.1f us\n", name,
+           latency[N_REQUESTS / 2] / 1e3, latency[N_REQUESTS * 99 / 100] / 1e3,
+           latency[N_REQUESTS - 1] / 1e3);
+}
+
+int main()
+{
+    fiber_init(N_WORKERS);
+    printf("request latency behind %d busy RR fibers on %d workers\n",
+           N_BACKGROUND, N_WORKERS);
+    run("RR", RR);
+    run("EDF", EDF);
+    fiber_destroy();
+    return 0;
+}
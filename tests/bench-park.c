@@ -0,0 +1,124 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fiber.h"
+
+#define N_ROUNDS 100000
+
+static fiber_t players[2];
+static fiber_mutex_t mutex;
+static fiber_cond_t cond;
+static int turn = 0, go = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void wait_go()
+{
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        fiber_yield();
+}
+
+/* hand the turn over by unparking the other player */
+static void park_player(void *data)
+{
+    int me = (int) (intptr_t) data;
+
+    wait_go();
+    for (int i = 0; i < N_ROUNDS; ++i) {
+        while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != me)
+            fiber_park();
+        __atomic_store_n(&turn, !me, __ATOMIC_RELEASE);
+        fiber_unpark(players[!me]);
+    }
+}
+
+/* hand the turn over through a mutex and a condition variable */
+static void cond_player(void *data)
+{
+    int me = (int) (intptr_t) data;
+
+    wait_go();
+    for (int i = 0; i < N_ROUNDS; ++i) {
+        fiber_mutex_lock(&mutex);
+        while (turn != me)
+            fiber_cond_wait(&cond, &mutex);
+        turn = !me;
+        fiber_cond_signal(&cond);
+        fiber_mutex_unlock(&mutex);
+    }
+}
+
+/* native threads, each wait a futex of its own */
+static void *futex_player(void *data)
+{
+    int me = (int) (intptr_t) data;
+
+    for (int i = 0; i < N_ROUNDS; ++i) {
+        int t;
+        while ((t = __atomic_load_n(&turn, __ATOMIC_ACQUIRE)) != me)
+            syscall(SYS_futex, &turn, FUTEX_WAIT_PRIVATE, t, NULL, NULL, 0);
+        __atomic_store_n(&turn, !me, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &turn, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+    return NULL;
+}
+
+static void run(const char *name, int workers, void (*player)(void *))
+{
+    fiber_init(workers);
+    fiber_mutex_init(&mutex);
+    fiber_cond_init(&cond);
+
+    turn = go = 0;
+    for (int i = 0; i < 2; ++i)
+        fiber_create(&players[i], player, (void *) (intptr_t) i);
+
+    uint64_t start = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < 2; ++i)
+        fiber_join(players[i], NULL);
+    uint64_t elapsed = now_ns() - start;
+    fiber_destroy();
+
+    printf("%-16s %d worker%s  round trip %8.1f ns\n", name, workers,
+           workers > 1 ? "s" : " ", (double) elapsed / N_ROUNDS);
+}
+
+static void run_native()
+{
+    pthread_t threads[2];
+
+    turn = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < 2; ++i)
+        pthread_create(&threads[i], NULL, futex_player, (void *) (intptr_t) i);
+    for (int i = 0; i < 2; ++i)
+        pthread_join(threads[i], NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    printf("%-16s 2 threads  round trip %8.1f ns\n", "futex",
+           (double) elapsed / N_ROUNDS);
+}
+
+int main()
+{
+    printf("ping-pong of two fibers, %d round trips\n", N_ROUNDS);
+    run("park/unpark", 1, park_player);
+    run("mutex/cond", 1, cond_player);
+    run("park/unpark", 2, park_player);
+    run("mutex/cond", 2, cond_player);
+    run_native();
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fiber.h"
+
+#define N_IDLE 4000
+#define N_IDLE_SHARED 200000 /* the scale shared stacks are meant for */
+#define N_SWITCHES 200000
+
+static fiber_mutex_t mutex;
+static fiber_cond_t cond;
+static int parked = 0;
+static int wake = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long rss_kib()
+{
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose(f);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* an idle connection: some state on the stack, then blocked for good */
+static void idle(void *data)
+{
+    volatile char state[1024];
+
+    memset((char *) state, (int) (intptr_t) data, sizeof(state));
+    fiber_mutex_lock(&mutex);
+    parked++;
+    while (!wake)
+        fiber_cond_wait(&cond, &mutex);
+    fiber_mutex_unlock(&mutex);
+}
+
+static void yielder(void *data)
+{
+    (void) data;
+    for (int i = 0; i < N_SWITCHES / 2; ++i)
+        fiber_yield();
+}
+
+static void run(const char *name, int shared, int n_idle)
+{
+    static fiber_t thread[N_IDLE_SHARED];
+    fiber_attr_t attr;
+
+    fiber_init(1);
+    fiber_mutex_init(&mutex);
+    fiber_cond_init(&cond);
+    fiber_attr_init(&attr);
+    fiber_attr_setsharedstack(&attr, shared);
+
+    long before = rss_kib();
+    parked = wake = 0;
+    for (int i = 0; i < n_idle; ++i)
+        fiber_create_attr(&thread[i], &attr, &idle, (void *) (intptr_t) i);
+    while (__atomic_load_n(&parked, __ATOMIC_SEQ_CST) < n_idle)
+        usleep(1000);
+    long after = rss_kib();
+
+    fiber_mutex_lock(&mutex);
+    wake = 1;
+    fiber_cond_broadcast(&cond);
+    fiber_mutex_unlock(&mutex);
+    for (int i = 0; i < n_idle; ++i)
+        fiber_join(thread[i], NULL);
+
+    /* two threads switching back and forth on a single worker */
+    uint64_t start = now_ns();
+    fiber_create_attr(&thread[0], &attr, &yielder, NULL);
+    fiber_create_attr(&thread[1], &attr, &yielder, NULL);
+    fiber_join(thread[0], NULL);
+    fiber_join(thread[1], NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    fiber_destroy();
+    printf(
+        "%-9s %6d idle fibers: %8ld KiB RSS (%5.2f KiB each), "
+        "switch %6.1f ns\n",
+        name, n_idle, after - before, (double) (after - before) / n_idle,
+        (double) elapsed / N_SWITCHES);
+}
+
+int main()
+{
+    /* the shared runs go first, the other one leaves its heap resident */
+    run("shared", 1, N_IDLE);
+    run("shared", 1, N_IDLE_SHARED);
+    run("dedicated", 0, N_IDLE);
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+
+#define N_YIELDS 1000
+#define N_ROUNDS 2000
+
+static volatile int pinned = 0;
+
+/* stays on worker 1 once pinned there */
+static void stay(void *data)
+{
+    (void) data;
+    while (!__atomic_load_n(&pinned, __ATOMIC_ACQUIRE))
+        fiber_yield();
+    fiber_yield();
+    for (int i = 0; i < N_YIELDS; ++i) {
+        assert(fiber_worker() == 1);
+        fiber_yield();
+    }
+}
+
+static fiber_mutex_t mtx;
+static fiber_cond_t cond;
+static int turn = 0, moves = 0;
+static int strict = 0; /* both players are pinned to worker 0 */
+static int last = -1, stayed = 0, hinted = 0;
+static volatile int go = 0;
+
+/* take turns with the other player, each wakeup handing over the ball */
+static void player(void *data)
+{
+    int me = (int) (intptr_t) data;
+
+    /* placed only once the main thread has pinned or hinted both */
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        fiber_yield();
+    fiber_yield();
+
+    for (int i = 0; i < N_ROUNDS; ++i) {
+        fiber_mutex_lock(&mtx);
+        while (turn != me)
+            fiber_cond_wait(&cond, &mtx);
+        int k = fiber_worker();
+        if (strict)
+            assert(k == 0);
+        stayed += k == last;
+        hinted += k == 1;
+        last = k;
+        turn = !me;
+        moves++;
+        fiber_cond_signal(&cond);
+        fiber_mutex_unlock(&mtx);
+    }
+}
+
+static void nop(void *data)
+{
+    (void) data;
+    fiber_yield();
+}
+
+static void play(int pin, int hint)
+{
+    fiber_t t[2];
+
+    turn = moves = go = 0;
+    last = -1, stayed = hinted = 0;
+    strict = pin;
+    for (int i = 0; i < 2; ++i) {
+        fiber_create(&t[i], player, (void *) (intptr_t) i);
+        if (pin)
+            assert(fiber_pin(t[i], 0) == 0);
+        if (hint)
+            assert(fiber_hint(t[i], 1) == 0);
+    }
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < 2; ++i)
+        fiber_join(t[i], NULL);
+    assert(moves == 2 * N_ROUNDS);
+
+    /* an idle worker may still steal the odd handoff */
+    if (hint)
+        assert(hinted > moves * 9 / 10);
+    else
+        assert(stayed > moves * 9 / 10);
+}
+
+int main()
+{
+    fiber_init(2);
+    fiber_mutex_init(&mtx);
+    fiber_cond_init(&cond);
+
+    /* the main thread is not a worker */
+    assert(fiber_worker() == -1);
+
+    fiber_t t;
+    fiber_create(&t, stay, NULL);
+    assert(fiber_pin(t, 2) == -1);
+    assert(fiber_pin(t, -2) == -1);
+    assert(fiber_hint(t, 2) == -1);
+    assert(fiber_pin(t, 1) == 0);
+    __atomic_store_n(&pinned, 1, __ATOMIC_RELEASE);
+    fiber_join(t, NULL);
+
+    /* unknown threads and shared-stack threads cannot be pinned */
+    assert(fiber_pin(t, 0) == -1);
+    assert(fiber_hint(t, 0) == -1);
+    fiber_attr_t attr;
+    fiber_attr_init(&attr);
+    fiber_attr_setsharedstack(&attr, 1);
+    fiber_create_attr(&t, &attr, nop, NULL);
+    assert(fiber_pin(t, 0) == -1);
+    fiber_join(t, NULL);
+
+    /* handoffs through the run-next slots, the bound run queue and hints */
+    play(0, 0);
+    play(1, 0);
+    play(0, 1);
+
+    fiber_destroy();
+    assert(fiber_cond_destroy(&cond) == 0);
+    assert(fiber_mutex_destroy(&mtx) == 0);
+    printf("affinity: OK\n");
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber.h"
+
+#define N_FIBERS 4
+#define N_BLOCKS 64
+#define N_CHURN 2000
+
+/* blocks handed over to the next fiber, to be released remotely */
+static unsigned char *handoff[N_FIBERS][N_BLOCKS];
+
+static void func(void *data)
+{
+    int id = (int) (intptr_t) data;
+    unsigned char *blocks[N_BLOCKS];
+
+    for (int i = 0; i < N_BLOCKS; ++i) {
+        size_t size = 1 + (size_t) i * 67; /* spans small and large blocks */
+        blocks[i] = fiber_alloc(size);
+        assert(blocks[i]);
+        assert(((uintptr_t) blocks[i] & 15) == 0);
+        memset(blocks[i], id, size);
+    }
+    for (int i = 0; i < N_BLOCKS; ++i) {
+        size_t size = 1 + (size_t) i * 67;
+        for (size_t j = 0; j < size; ++j)
+            assert(blocks[i][j] == (unsigned char) id);
+        if (i & 1)
+            fiber_free(blocks[i]);
+        else
+            handoff[id][i] = blocks[i];
+    }
+
+    /* scratch memory which vanishes along with this fiber */
+    for (int i = 0; i < 128; ++i) {
+        char *buf = fiber_arena_alloc(100);
+        assert(buf);
+        assert(((uintptr_t) buf & 15) == 0);
+        memset(buf, 'x', 100);
+    }
+    assert(fiber_arena_alloc(8192));
+
+    fiber_yield();
+
+    /* free what the previous fiber handed over */
+    int prev = (id + N_FIBERS - 1) % N_FIBERS;
+    for (int i = 0; i < N_BLOCKS; ++i) {
+        fiber_free(handoff[prev][i]);
+        handoff[prev][i] = NULL;
+    }
+}
+
+/* each worker has thread-local state of its own, such as errno */
+static int *errno_at[2];
+
+static void where(void *data)
+{
+    int k = (int) (intptr_t) data;
+    fiber_t self;
+
+    fiber_self(&self);
+    assert(fiber_pin(self, k) == 0);
+    fiber_yield();
+    assert(fiber_worker() == k);
+    errno_at[k] = &errno;
+}
+
+static void nop(void *data)
+{
+    (void) data;
+}
+
+/* malloc() behind oversized blocks and TCBs, from both workers at once */
+static void churn(void *data)
+{
+    (void) data;
+    for (int i = 0; i < N_CHURN; ++i) {
+        size_t size = 4096 + (size_t) i;
+        unsigned char *p = fiber_alloc(size);
+        assert(p);
+        memset(p, i, size);
+        assert(p[size - 1] == (unsigned char) i);
+        fiber_free(p);
+
+        if (!(i % 64)) {
+            fiber_t t;
+            fiber_attr_t attr;
+            fiber_attr_init(&attr);
+            fiber_attr_setstacksize(&attr, 64 * 1024);
+            assert(fiber_create_attr(&t, &attr, nop, NULL) == 0);
+            fiber_join(t, NULL);
+        }
+    }
+}
+
+int main()
+{
+    fiber_init(2);
+
+    /* outside of the workers the allocator falls back to the heap */
+    void *p = fiber_alloc(32);
+    assert(p);
+    fiber_free(p);
+    fiber_free(NULL);
+    assert(!fiber_arena_alloc(16));
+
+    fiber_t thread[N_FIBERS];
+    for (int i = 0; i < N_FIBERS; ++i)
+        fiber_create(&thread[i], &func, (void *) (intptr_t) i);
+    for (int i = 0; i < N_FIBERS; ++i)
+        fiber_join(thread[i], NULL);
+
+    /* releasing leftovers from the main thread goes through remote lists */
+    for (int i = 0; i < N_FIBERS; ++i) {
+        for (int j = 0; j < N_BLOCKS; ++j)
+            fiber_free(handoff[i][j]);
+    }
+
+    fiber_t t[N_FIBERS];
+    for (int k = 0; k < 2; ++k)
+        fiber_create(&t[k], where, (void *) (intptr_t) k);
+    for (int k = 0; k < 2; ++k)
+        fiber_join(t[k], NULL);
+    assert(errno_at[0] != errno_at[1]);
+    assert(errno_at[0] != &errno && errno_at[1] != &errno);
+
+    for (int i = 0; i < N_FIBERS; ++i)
+        fiber_create(&t[i], churn, NULL);
+    for (int i = 0; i < N_FIBERS; ++i)
+        fiber_join(t[i], NULL);
+
+    fiber_destroy();
+    printf("alloc: OK\n");
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+
+static fiber_mutex_t mtx;
+static fiber_cond_t cond;
+static int cleanups;
+static volatile int spinning;
+
+static void count(void *data)
+{
+    (void) data;
+    __atomic_add_fetch(&cleanups, 1, __ATOMIC_SEQ_CST);
+}
+
+static void unlock(void *data)
+{
+    count(NULL);
+    fiber_mutex_unlock(data);
+}
+
+/* blocks on a condition which is never signaled */
+static void waiter(void *data)
+{
+    (void) data;
+    fiber_mutex_lock(&mtx);
+    fiber_cleanup_push(unlock, &mtx);
+    while (1)
+        fiber_cond_wait(&cond, &mtx);
+}
+
+/* keeps yielding, which is a cancellation point */
+static void yielder(void *data)
+{
+    (void) data;
+    fiber_cleanup_push(count, NULL);
+    while (1)
+        fiber_yield();
+}
+
+/* never parks, so only asynchronous cancellation stops it */
+static void spinner(void *data)
+{
+    (void) data;
+    assert(fiber_setcanceltype(FIBER_CANCEL_ASYNCHRONOUS, NULL) == 0);
+    fiber_cleanup_push(count, NULL);
+    spinning = 1;
+    while (1)
+        ;
+}
+
+/* pops its handlers, so cancellation of others must not affect it */
+static void finisher(void *data)
+{
+    (void) data;
+    fiber_cleanup_push(count, NULL);
+    fiber_cleanup_pop(1);
+    fiber_cleanup_push(count, NULL);
+    fiber_cleanup_pop(0);
+}
+
+int main()
+{
+    fiber_t t[5];
+
+    fiber_init(2);
+    fiber_mutex_init(&mtx);
+    fiber_cond_init(&cond);
+
+    assert(fiber_create(&t[0], waiter, NULL) == 0);
+    assert(fiber_create(&t[1], yielder, NULL) == 0);
+    assert(fiber_create(&t[2], waiter, NULL) == 0);
+    assert(fiber_create(&t[3], spinner, NULL) == 0);
+    assert(fiber_create(&t[4], finisher, NULL) == 0);
+
+    assert(fiber_join(t[4], NULL) == 0);
+    assert(cleanups == 1);
+
+    /* explicit cancellation of blocked and yielding threads */
+    assert(fiber_cancel(t[0]) == 0);
+    assert(fiber_join(t[0], NULL) == FIBER_CANCELED);
+    assert(fiber_cancel(t[1]) == 0);
+    assert(fiber_join(t[1], NULL) == FIBER_CANCELED);
+    assert(cleanups == 3);
+
+    /* the deadline cancels the waiter without anybody touching it */
+    assert(fiber_set_deadline(t[2], 20000) == 0);
+    assert(fiber_join(t[2], NULL) == FIBER_CANCELED);
+    assert(cleanups == 4);
+
+    /* the spinner is stopped by preemption */
+    while (!spinning)
+        ;
+    assert(fiber_cancel(t[3]) == 0);
+    assert(fiber_join(t[3], NULL) == FIBER_CANCELED);
+    assert(cleanups == 5);
+
+    /* the thread IDs are gone */
+    assert(fiber_cancel(t[0]) == -1);
+    assert(fiber_set_deadline(t[1], 1) == -1);
+
+    /* a deadline stops work which never parks as well */
+    fiber_t late;
+    assert(fiber_create(&late, spinner, NULL) == 0);
+    assert(fiber_set_deadline(late, 1) == 0);
+    assert(fiber_join(late, NULL) == FIBER_CANCELED);
+
+    fiber_destroy();
+    assert(fiber_mutex_destroy(&mtx) == 0);
+    assert(fiber_cond_destroy(&cond) == 0);
+    printf("cancel: OK\n");
+    return 0;
+}
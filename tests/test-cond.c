@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -52,8 +53,8 @@ int main()
     fiber_create(&t1, func1, NULL);
     fiber_create(&t2, func2, NULL);
 
-    fiber_cond_destroy(&cond);
-    fiber_mutex_destroy(&mtx);
     fiber_destroy();
+    assert(fiber_cond_destroy(&cond) == 0);
+    assert(fiber_mutex_destroy(&mtx) == 0);
     return 0;
 }
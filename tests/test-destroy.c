@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fiber.h"
+
+static fiber_mutex_t mtx;
+static fiber_cond_t cond;
+static int counter;
+static int unwound;
+
+static void worker(void *data)
+{
+    (void) data;
+    char *buf = fiber_arena_alloc(256);
+    assert(buf);
+    fiber_mutex_lock(&mtx);
+    counter++;
+    fiber_mutex_unlock(&mtx);
+    fiber_yield();
+}
+
+static void unlock(void *data)
+{
+    unwound++;
+    fiber_mutex_unlock(data);
+}
+
+/* never signaled, so it stays blocked until the runtime shuts down */
+static void sleeper(void *data)
+{
+    (void) data;
+    fiber_mutex_lock(&mtx);
+    fiber_cleanup_push(unlock, &mtx);
+    fiber_cond_wait(&cond, &mtx);
+    assert(0);
+}
+
+static volatile int stop = 0;
+static int spun = 0;
+
+static void spin_unwind(void *data)
+{
+    (void) data;
+    __atomic_add_fetch(&spun, 1, __ATOMIC_RELAXED);
+}
+
+/* stays runnable until canceled, nobody ever sets stop */
+static void spinner(void *data)
+{
+    (void) data;
+    fiber_cleanup_push(spin_unwind, NULL);
+    while (!stop)
+        fiber_yield();
+    assert(0);
+}
+
+/* never reaches a park point, only asynchronous cancellation stops it */
+static void busy(void *data)
+{
+    (void) data;
+    fiber_cleanup_push(spin_unwind, NULL);
+    fiber_setcanceltype(FIBER_CANCEL_ASYNCHRONOUS, NULL);
+    while (!stop)
+        ;
+    assert(0);
+}
+
+static int steps = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* keeps making progress for longer than any fixed drain would allow */
+static void stepper(void *data)
+{
+    (void) data;
+    for (int i = 0; i < 30; ++i) {
+        uint64_t due = now_ns() + 5000000;
+        while (now_ns() < due)
+            ;
+        __atomic_add_fetch(&steps, 1, __ATOMIC_RELAXED);
+        fiber_yield();
+    }
+}
+
+int main()
+{
+    fiber_t tid;
+
+    /* nothing to run on before fiber_init() */
+    assert(fiber_create(&tid, worker, NULL) == -1);
+    assert(fiber_init(0) == -1);
+
+    for (int round = 0; round < 100; ++round) {
+        assert(fiber_init(2) == 0);
+        /* the runtime is initialized once */
+        assert(fiber_init(2) == -1);
+
+        fiber_mutex_init(&mtx);
+        fiber_cond_init(&cond);
+        counter = 0;
+        unwound = 0;
+
+        fiber_t thread[8];
+        for (int i = 0; i < 8; ++i)
+            assert(fiber_create(&thread[i], worker, NULL) == 0);
+        for (int i = 0; i < 4; ++i)
+            assert(fiber_join(thread[i], NULL) == 0);
+        assert(fiber_create(&tid, sleeper, NULL) == 0);
+
+        /* waits for the remaining workers, cancels the blocked sleeper */
+        fiber_destroy();
+        assert(counter == 8);
+        assert(unwound == 1);
+        assert(fiber_cond_destroy(&cond) == 0);
+        assert(fiber_mutex_destroy(&mtx) == 0);
+    }
+
+    /* a second shutdown is harmless */
+    fiber_destroy();
+
+    /* runnable threads are waited for, however long they take */
+    assert(fiber_init(2) == 0);
+    for (int i = 0; i < 2; ++i)
+        assert(fiber_create(&tid, stepper, NULL) == 0);
+    fiber_destroy();
+    assert(steps == 60);
+
+    /* threads which never stop running get canceled after the timeout */
+    assert(fiber_init(2) == 0);
+    for (int i = 0; i < 3; ++i)
+        assert(fiber_create(&tid, spinner, NULL) == 0);
+    assert(fiber_create(&tid, busy, NULL) == 0);
+    fiber_destroy_timeout(100000);
+    assert(spun == 4);
+
+    printf("destroy: OK\n");
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+
+#define N_EDF 4
+#define N_RR 2
+
+static int order[N_EDF + N_RR];
+static int ran = 0;
+
+static void record(void *data)
+{
+    order[__atomic_fetch_add(&ran, 1, __ATOMIC_SEQ_CST)] =
+        (int) (intptr_t) data;
+}
+
+/* due right away, so that nothing it creates runs before it is done */
+static void creator(void *data)
+{
+    static const unsigned long deadline[N_EDF] = {300000, 100000, 400000,
+                                                  200000};
+    fiber_attr_t attr;
+    fiber_t thread;
+
+    (void) data;
+    for (int i = 0; i < N_RR; ++i)
+        fiber_create(&thread, &record, (void *) (intptr_t) (100 + i));
+
+    fiber_attr_init(&attr);
+    assert(fiber_attr_setschedpolicy(&attr, EDF) == 0);
+    for (int i = 0; i < N_EDF; ++i) {
+        fiber_attr_setdeadline(&attr, deadline[i]);
+        fiber_create_attr(&thread, &attr, &record,
+                          (void *) (intptr_t) (deadline[i] / 100000));
+    }
+}
+
+int main()
+{
+    fiber_attr_t attr;
+    fiber_t thread;
+
+    fiber_init(1);
+
+    fiber_attr_init(&attr);
+    assert(fiber_attr_setschedpolicy(&attr, 42) == -1);
+    fiber_attr_setschedpolicy(&attr, EDF);
+    fiber_attr_setdeadline(&attr, 0);
+    fiber_create_attr(&thread, &attr, &creator, NULL);
+
+    fiber_destroy();
+
+    /* EDF threads in order of their deadlines, before any RR thread */
+    assert(ran == N_EDF + N_RR);
+    for (int i = 0; i < N_EDF; ++i)
+        assert(order[i] == i + 1);
+    for (int i = N_EDF; i < N_EDF + N_RR; ++i)
+        assert(order[i] >= 100);
+
+    printf("edf: OK\n");
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber.h"
+
+#define N_ITEMS 100000
+#define FIB_N 20
+#define FIB_CUTOFF 10
+
+static long items[N_ITEMS];
+
+static int square(size_t lo, size_t hi, void *arg)
+{
+    long *out = arg;
+    for (size_t i = lo; i < hi; ++i)
+        out[i] = (long) i * (long) i;
+    return 0;
+}
+
+static long fib_serial(long n)
+{
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+struct fib {
+    long n, result;
+};
+
+/* divide and conquer, each level waits for the tasks it spawned */
+static int fib_task(void *arg)
+{
+    struct fib *f = arg;
+    if (f->n < FIB_CUTOFF) {
+        f->result = fib_serial(f->n);
+        return 0;
+    }
+
+    fiber_group_t group;
+    struct fib a = {f->n - 1, 0}, b = {f->n - 2, 0};
+    fiber_group_init(&group);
+    fiber_group_spawn(&group, fib_task, &a);
+    fiber_group_spawn(&group, fib_task, &b);
+    int error = fiber_group_wait(&group);
+    f->result = a.result + b.result;
+    return error;
+}
+
+static int fail_at(size_t lo, size_t hi, void *arg)
+{
+    (void) arg;
+    return lo <= 5 && 5 < hi ? 42 : 0;
+}
+
+/* a chunk with a large frame, as parsers and compressors have */
+static int big_frame(size_t lo, size_t hi, void *arg)
+{
+    volatile char buf[256 * 1024];
+
+    (void) arg;
+    for (size_t i = 0; i < sizeof(buf); i += 4096)
+        buf[i] = (char) lo;
+    return buf[sizeof(buf) - 4096] == (char) lo && hi == lo + 1 ? 0 : -1;
+}
+
+static int ran = 0;
+
+static int count(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&ran, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int slow(void *arg)
+{
+    fiber_group_t *group = arg;
+    /* wait for the failure to cancel the group */
+    while (!fiber_group_canceled(group))
+        ;
+    return 0;
+}
+
+static int failing(void *arg)
+{
+    return (int) (intptr_t) arg;
+}
+
+static void check_results(void)
+{
+    for (size_t i = 0; i < N_ITEMS; ++i)
+        assert(items[i] == (long) i * (long) i);
+}
+
+/* a fiber parks in fiber_group_wait() instead of blocking its worker */
+static void fiber_func(void *data)
+{
+    struct fib f = {FIB_N, 0};
+    fiber_group_t group;
+
+    (void) data;
+    fiber_group_init(&group);
+    fiber_group_spawn(&group, fib_task, &f);
+    assert(fiber_group_wait(&group) == 0);
+    assert(f.result == fib_serial(FIB_N));
+
+    memset(items, 0, sizeof(items));
+    assert(fiber_parallel_for(0, N_ITEMS, 0, square, items) == 0);
+    check_results();
+}
+
+int main()
+{
+    fiber_init(4);
+
+    /* from the main thread, with an explicit grain size */
+    assert(fiber_parallel_for(0, N_ITEMS, 1000, square, items) == 0);
+    check_results();
+
+    /* tasks run on the stacks of the workers, which are not small */
+    assert(fiber_parallel_for(0, 64, 1, big_frame, NULL) == 0);
+
+    /* nested groups spawned by tasks */
+    struct fib f = {FIB_N, 0};
+    fiber_group_t group;
+    fiber_group_init(&group);
+    assert(fiber_group_spawn(&group, fib_task, &f) == 0);
+    assert(fiber_group_wait(&group) == 0);
+    assert(f.result == fib_serial(FIB_N));
+
+    /* the first error is reported and the remaining tasks are dropped */
+    assert(fiber_parallel_for(0, 1000, 1, fail_at, NULL) == 42);
+    fiber_group_init(&group);
+    fiber_group_spawn(&group, failing, (void *) (intptr_t) 42);
+    while (!fiber_group_canceled(&group))
+        ;
+    for (int i = 0; i < 100; ++i)
+        fiber_group_spawn(&group, count, NULL);
+    assert(fiber_group_wait(&group) == 42);
+    assert(ran == 0);
+
+    /* a failure cancels a sibling which is still running */
+    fiber_group_init(&group);
+    fiber_group_spawn(&group, slow, &group);
+    fiber_group_spawn(&group, failing, (void *) (intptr_t) 7);
+    assert(fiber_group_wait(&group) == 7);
+
+    /* the group is reusable once waited for */
+    assert(fiber_group_wait(&group) == 0);
+    assert(!fiber_group_canceled(&group));
+
+    fiber_t thread;
+    fiber_create(&thread, &fiber_func, NULL);
+    fiber_join(thread, NULL);
+
+    fiber_destroy();
+    printf("group: OK\n");
+    return 0;
+}
@@ -30,7 +30,7 @@ int main()
     for (int i = 0; i < 16; ++i)
         fiber_create(&thread[i], &func, NULL);
 
-    fiber_mutex_destroy(&mtx);
     fiber_destroy();
+    assert(fiber_mutex_destroy(&mtx) == 0);
     return 0;
 }
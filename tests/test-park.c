@@ -0,0 +1,163 @@
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+
+#define N_ROUNDS 20000
+#define N_WAITERS 8
+
+/* a one-shot latch built on fiber_park()/fiber_unpark() */
+typedef struct {
+    fiber_mutex_t mutex;
+    int count;
+    int n_waiters;
+    fiber_t waiters[N_WAITERS];
+} latch_t;
+
+static latch_t latch;
+static int passed = 0;
+
+static void latch_wait(latch_t *l)
+{
+    fiber_t self;
+
+    assert(fiber_self(&self) == 0);
+    fiber_mutex_lock(&l->mutex);
+    if (!l->count) {
+        fiber_mutex_unlock(&l->mutex);
+        return;
+    }
+    l->waiters[l->n_waiters++] = self;
+    fiber_mutex_unlock(&l->mutex);
+
+    /* a token may be left over, so the count decides */
+    while (__atomic_load_n(&l->count, __ATOMIC_ACQUIRE))
+        fiber_park();
+}
+
+static void latch_count_down(latch_t *l)
+{
+    fiber_mutex_lock(&l->mutex);
+    if (__atomic_sub_fetch(&l->count, 1, __ATOMIC_RELEASE)) {
+        fiber_mutex_unlock(&l->mutex);
+        return;
+    }
+    int n = l->n_waiters;
+    l->n_waiters = 0;
+    fiber_mutex_unlock(&l->mutex);
+
+    for (int i = 0; i < n; ++i)
+        assert(fiber_unpark(l->waiters[i]) == 0);
+}
+
+static void waiter(void *data)
+{
+    (void) data;
+    latch_wait(&latch);
+    __atomic_add_fetch(&passed, 1, __ATOMIC_RELAXED);
+}
+
+/* a token given before parking is not lost, and tokens do not add up */
+static void self_unpark(void *data)
+{
+    fiber_t self;
+    int *parks = data;
+
+    fiber_self(&self);
+    assert(fiber_unpark(self) == 0);
+    assert(fiber_unpark(self) == 0);
+    fiber_park();
+    __atomic_store_n(parks, 1, __ATOMIC_RELEASE);
+    fiber_park();
+    __atomic_store_n(parks, 2, __ATOMIC_RELEASE);
+}
+
+static fiber_t players[2];
+static int turn = 0, go = 0, moves = 0;
+
+/* take turns with the other player, handing over by unparking it */
+static void player(void *data)
+{
+    int me = (int) (intptr_t) data;
+
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        fiber_yield();
+
+    for (int i = 0; i < N_ROUNDS; ++i) {
+        while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != me)
+            fiber_park();
+        moves++;
+        __atomic_store_n(&turn, !me, __ATOMIC_RELEASE);
+        fiber_unpark(players[!me]);
+    }
+}
+
+static int asleep = 0;
+
+static void sleeper(void *data)
+{
+    (void) data;
+    __atomic_store_n(&asleep, 1, __ATOMIC_RELEASE);
+    for (;;)
+        fiber_park();
+}
+
+static void wait_for(int *value, int expected)
+{
+    while (__atomic_load_n(value, __ATOMIC_ACQUIRE) != expected)
+        sched_yield();
+}
+
+int main()
+{
+    fiber_t t;
+
+    fiber_init(2);
+
+    /* native threads neither have an ID nor park */
+    assert(fiber_self(&t) == -1);
+    assert(fiber_park() == -1);
+    assert(fiber_unpark((fiber_t) -1) == -1);
+
+    int parks = 0;
+    fiber_create(&t, self_unpark, &parks);
+    wait_for(&parks, 1);
+    assert(fiber_unpark(t) == 0);
+    fiber_join(t, NULL);
+    assert(parks == 2);
+    assert(fiber_unpark(t) == -1);
+
+    /* waiters released by a native thread */
+    fiber_t threads[N_WAITERS];
+    fiber_mutex_init(&latch.mutex);
+    latch.count = 2;
+    for (int i = 0; i < N_WAITERS; ++i)
+        fiber_create(&threads[i], waiter, NULL);
+    latch_count_down(&latch);
+    assert(__atomic_load_n(&passed, __ATOMIC_RELAXED) == 0);
+    latch_count_down(&latch);
+    for (int i = 0; i < N_WAITERS; ++i)
+        fiber_join(threads[i], NULL);
+    assert(passed == N_WAITERS);
+    assert(fiber_mutex_destroy(&latch.mutex) == 0);
+
+    /* handoffs between fibers on either worker */
+    for (int i = 0; i < 2; ++i)
+        fiber_create(&players[i], player, (void *) (intptr_t) i);
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < 2; ++i)
+        fiber_join(players[i], NULL);
+    assert(moves == 2 * N_ROUNDS);
+
+    /* a parked thread is woken up to act on its cancellation */
+    fiber_create(&t, sleeper, NULL);
+    wait_for(&asleep, 1);
+    fiber_cancel(t);
+    assert(fiber_join(t, NULL) == FIBER_CANCELED);
+
+    fiber_destroy();
+    printf("park: OK\n");
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+
+#define N_MEDIUM 3
+#define N_SPINS 50
+#define N_HOLD 20
+
+static fiber_mutex_t m1, m2;
+static int medium_runs = 0, medium_done = 0, seen = -1;
+
+static void create_prio(void (*func)(void *), void *arg, int prio)
+{
+    fiber_t t;
+    fiber_attr_t attr;
+
+    fiber_attr_init(&attr);
+    assert(fiber_attr_setpriority(&attr, prio) == 0);
+    assert(fiber_create_attr(&t, &attr, func, arg) == 0);
+}
+
+/* CPU-bound work of a medium priority */
+static void medium(void *data)
+{
+    (void) data;
+    for (int i = 0; i < N_SPINS; ++i) {
+        medium_runs++;
+        fiber_yield();
+    }
+    medium_done++;
+}
+
+/* notes how often medium threads ran before it got the mutex */
+static void high(void *data)
+{
+    fiber_mutex_t *mutex = data;
+
+    fiber_mutex_lock(mutex);
+    seen = medium_runs;
+    fiber_mutex_unlock(mutex);
+}
+
+/* holds m2 and waits for m1, while high waits for m2 */
+static void middle(void *data)
+{
+    (void) data;
+    fiber_mutex_lock(&m2);
+    for (int i = 0; i < N_MEDIUM; ++i)
+        create_prio(medium, NULL, 5);
+    create_prio(high, &m2, 0);
+    fiber_mutex_lock(&m1);
+    fiber_mutex_unlock(&m1);
+    fiber_mutex_unlock(&m2);
+}
+
+/* holds m1 for a while, at the priority of whoever waits for it */
+static void low(void *data)
+{
+    int chain = (int) (intptr_t) data;
+
+    fiber_mutex_lock(&m1);
+    if (chain)
+        create_prio(middle, NULL, 10);
+    else {
+        for (int i = 0; i < N_MEDIUM; ++i)
+            create_prio(medium, NULL, 8);
+        create_prio(high, &m1, 0);
+    }
+    for (int i = 0; i < N_HOLD; ++i)
+        fiber_yield();
+    fiber_mutex_unlock(&m1);
+
+    /* back at its own priority, behind the medium ones */
+    fiber_yield();
+    assert(medium_done == N_MEDIUM);
+}
+
+static fiber_cond_t cond;
+static int waiting = 0, woken = 0, order[2];
+
+static void waiter(void *data)
+{
+    fiber_mutex_lock(&m1);
+    waiting++;
+    fiber_cond_wait(&cond, &m1);
+    order[woken++] = (int) (intptr_t) data;
+    fiber_mutex_unlock(&m1);
+}
+
+static void wait_for(int *counter, int value)
+{
+    for (;;) {
+        fiber_mutex_lock(&m1);
+        int done = *counter == value;
+        fiber_mutex_unlock(&m1);
+        if (done)
+            break;
+        sched_yield();
+    }
+}
+
+static int ran[3], n_ran = 0;
+
+static void note(void *data)
+{
+    ran[n_ran++] = (int) (intptr_t) data;
+}
+
+/* a low-priority waiter woken up goes behind a runnable higher priority one,
+ * even though it would run next on the worker of its waker
+ */
+static void waker(void *data)
+{
+    (void) data;
+    create_prio(note, (void *) 0, 0);
+    fiber_cond_signal(&cond);
+    fiber_yield();
+    note((void *) 1);
+}
+
+static void slow_waiter(void *data)
+{
+    fiber_mutex_lock(&m1);
+    waiting++;
+    fiber_cond_wait(&cond, &m1);
+    fiber_mutex_unlock(&m1);
+    note(data);
+}
+
+static void run(int chain)
+{
+    fiber_t t;
+    fiber_attr_t attr;
+
+    medium_runs = medium_done = 0;
+    seen = -1;
+    fiber_attr_init(&attr);
+    fiber_attr_setpriority(&attr, FIBER_PRIO_LOWEST);
+    fiber_create_attr(&t, &attr, low, (void *) (intptr_t) chain);
+    fiber_join(t, NULL);
+    assert(seen == 0);
+}
+
+int main()
+{
+    fiber_attr_t attr;
+
+    /* a single worker makes the order of priorities deterministic */
+    fiber_init(1);
+    fiber_mutex_init(&m1);
+    fiber_mutex_init(&m2);
+    fiber_cond_init(&cond);
+
+    fiber_attr_init(&attr);
+    assert(fiber_attr_setpriority(&attr, -1) == -1);
+    assert(fiber_attr_setpriority(&attr, FIBER_PRIO_LOWEST + 1) == -1);
+    assert(fiber_setpriority(0) == -1);
+
+    /* high waits for m1, held by low */
+    run(0);
+
+    /* high waits for m2, held by middle, which waits for m1, held by low */
+    run(1);
+
+    /* the waiter of the highest priority is signaled first */
+    fiber_attr_setpriority(&attr, 10);
+    fiber_t t;
+    fiber_create_attr(&t, &attr, waiter, (void *) 10);
+    wait_for(&waiting, 1);
+    fiber_attr_setpriority(&attr, 2);
+    fiber_create_attr(&t, &attr, waiter, (void *) 2);
+    wait_for(&waiting, 2);
+    fiber_cond_signal(&cond);
+    wait_for(&woken, 1);
+    fiber_cond_signal(&cond);
+    wait_for(&woken, 2);
+    assert(order[0] == 2 && order[1] == 10);
+
+    /* the run-next slot does not jump ahead of a higher priority */
+    fiber_attr_setpriority(&attr, 15);
+    fiber_create_attr(&t, &attr, slow_waiter, (void *) 15);
+    wait_for(&waiting, 3);
+    fiber_attr_setpriority(&attr, 1);
+    fiber_create_attr(&t, &attr, waker, NULL);
+    wait_for(&n_ran, 3);
+    assert(ran[0] == 0 && ran[1] == 1 && ran[2] == 15);
+
+    fiber_destroy();
+    assert(fiber_mutex_destroy(&m1) == 0);
+    assert(fiber_mutex_destroy(&m2) == 0);
+    assert(fiber_cond_destroy(&cond) == 0);
+    printf("prio: OK\n");
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+
+#define N_FIBERS 8
+#define N_ROUNDS 200
+#define N_MANY 10000
+
+static fiber_mutex_t mutex;
+static fiber_cond_t cond;
+static int turn = 0;
+static int done = 0;
+
+/* keep data on the stack across switches, at different depths */
+static long nest(int id, int depth)
+{
+    volatile long local[64];
+    long sum = 0;
+
+    for (int i = 0; i < 64; ++i)
+        local[i] = id * 1000 + depth * 64 + i;
+    if (depth)
+        sum = nest(id, depth - 1);
+    fiber_yield();
+    for (int i = 0; i < 64; ++i) {
+        assert(local[i] == id * 1000 + depth * 64 + i);
+        sum += local[i];
+    }
+    return sum;
+}
+
+static void shared_func(void *data)
+{
+    int id = (int) (intptr_t) data;
+    long expected = nest(id, id % 4);
+
+    for (int r = 0; r < N_ROUNDS; ++r)
+        assert(nest(id, id % 4) == expected);
+
+    /* block and get woken up in turns, from whichever worker */
+    fiber_mutex_lock(&mutex);
+    while (turn != id)
+        fiber_cond_wait(&cond, &mutex);
+    turn++;
+    fiber_cond_broadcast(&cond);
+    fiber_mutex_unlock(&mutex);
+
+    __atomic_add_fetch(&done, 1, __ATOMIC_SEQ_CST);
+}
+
+static int unwound = 0;
+
+static void cleanup(void *arg)
+{
+    (void) arg;
+    unwound++;
+    fiber_mutex_unlock(&mutex);
+}
+
+static void sleeper(void *data)
+{
+    (void) data;
+    fiber_mutex_lock(&mutex);
+    fiber_cleanup_push(cleanup, NULL);
+    while (1)
+        fiber_cond_wait(&cond, &mutex);
+}
+
+#define N_INDICES 64
+
+static int marks[N_INDICES];
+static int looper_worker = -1;
+static int looped = 0, yields = 0;
+
+static int mark(size_t lo, size_t hi, void *arg)
+{
+    (void) arg;
+    /* a stolen chunk holds on until the caller has blocked on the group and
+     * the yielder has taken over the shared stack
+     */
+    if (fiber_worker() != looper_worker) {
+        while (__atomic_load_n(&yields, __ATOMIC_ACQUIRE) < 100)
+            ;
+    }
+    /* long enough for the other worker to wake up and steal some */
+    for (volatile int spin = 0; spin < 100000; ++spin)
+        ;
+    for (size_t i = lo; i < hi; ++i)
+        __atomic_add_fetch(&marks[i], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void looper(void *data)
+{
+    (void) data;
+    looper_worker = fiber_worker();
+    assert(fiber_parallel_for(0, N_INDICES, 1, mark, NULL) == 0);
+    __atomic_store_n(&looped, 1, __ATOMIC_RELEASE);
+}
+
+/* take over the shared stack while the looper waits for its chunks */
+static void yielder(void *data)
+{
+    (void) data;
+    while (!__atomic_load_n(&looped, __ATOMIC_ACQUIRE)) {
+        nest(N_FIBERS, 3);
+        __atomic_add_fetch(&yields, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static int released = 0, many_done = 0;
+
+static void many(void *data)
+{
+    (void) data;
+    while (!__atomic_load_n(&released, __ATOMIC_ACQUIRE))
+        fiber_park();
+    __atomic_add_fetch(&many_done, 1, __ATOMIC_RELAXED);
+}
+
+/* shared-stack threads created by a thread stay on its worker */
+static void spawner(void *data)
+{
+    fiber_attr_t attr;
+    fiber_t thread[N_FIBERS / 2];
+
+    (void) data;
+    fiber_attr_init(&attr);
+    fiber_attr_setsharedstack(&attr, 1);
+    for (int i = 0; i < N_FIBERS / 2; ++i)
+        fiber_create_attr(&thread[i], &attr, &shared_func,
+                          (void *) (intptr_t) (N_FIBERS / 2 + i));
+    for (int i = 0; i < N_FIBERS / 2; ++i)
+        fiber_join(thread[i], NULL);
+}
+
+static void loop_spawner(void *data)
+{
+    fiber_attr_t attr;
+    fiber_t loop, yield;
+
+    (void) data;
+    fiber_attr_init(&attr);
+    fiber_attr_setsharedstack(&attr, 1);
+    fiber_create_attr(&yield, &attr, &yielder, NULL);
+    fiber_create_attr(&loop, &attr, &looper, NULL);
+    fiber_join(loop, NULL);
+    fiber_join(yield, NULL);
+}
+
+int main()
+{
+    fiber_attr_t attr;
+    fiber_t thread[N_FIBERS / 2], other, sleep;
+
+    fiber_init(2);
+    fiber_mutex_init(&mutex);
+    fiber_cond_init(&cond);
+
+    fiber_attr_init(&attr);
+    fiber_attr_setsharedstack(&attr, 1);
+    for (int i = 0; i < N_FIBERS / 2; ++i)
+        fiber_create_attr(&thread[i], &attr, &shared_func,
+                          (void *) (intptr_t) i);
+    fiber_create(&other, &spawner, NULL);
+    fiber_create_attr(&sleep, &attr, &sleeper, NULL);
+
+    for (int i = 0; i < N_FIBERS / 2; ++i)
+        fiber_join(thread[i], NULL);
+    fiber_join(other, NULL);
+    assert(done == N_FIBERS);
+
+    /* a shared-stack thread keeps waiting on a group of its own */
+    fiber_create(&other, &loop_spawner, NULL);
+    fiber_join(other, NULL);
+    for (int i = 0; i < N_INDICES; ++i)
+        assert(marks[i] == 1);
+
+    /* more threads alive at once than one chunk of thread IDs holds */
+    static fiber_t crowd[N_MANY];
+    for (int i = 0; i < N_MANY; ++i)
+        assert(fiber_create_attr(&crowd[i], &attr, &many, NULL) == 0);
+    __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < N_MANY; ++i) {
+        assert(fiber_unpark(crowd[i]) == 0);
+        assert(fiber_join(crowd[i], NULL) == 0);
+    }
+    assert(many_done == N_MANY);
+
+    /* a blocked shared-stack thread unwinds at shutdown */
+    fiber_destroy();
+    assert(unwound == 1);
+    assert(fiber_mutex_destroy(&mutex) == 0);
+    assert(fiber_cond_destroy(&cond) == 0);
+
+    printf("shared: OK\n");
+    return 0;
+}
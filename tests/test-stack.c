@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber.h"
+
+static int depth(int n)
+{
+    volatile char buf[1024];
+    memset((char *) buf, n, sizeof(buf));
+    return n ? depth(n - 1) + buf[0] : buf[0];
+}
+
+static void shallow(void *data)
+{
+    (void) data;
+    depth(0);
+}
+
+static void deep(void *data)
+{
+    (void) data;
+    depth(16);
+}
+
+static void small(void *data)
+{
+    (void) data;
+    depth(2);
+}
+
+int main()
+{
+    fiber_attr_t attr;
+    fiber_t thread;
+
+    fiber_init(2);
+
+    /* too small to take a signal frame */
+    fiber_attr_init(&attr);
+    assert(fiber_attr_setstacksize(&attr, 4096) == -1);
+    assert(fiber_stack_hint(&small, 4096) == -1);
+
+    assert(fiber_stack_stats(1) == 0);
+    fiber_create(&thread, &shallow, NULL);
+    fiber_join(thread, NULL);
+    fiber_create(&thread, &deep, NULL);
+    fiber_join(thread, NULL);
+    assert(fiber_stack_peak(&shallow) > 1024);
+    assert(fiber_stack_peak(&deep) > 16 * 1024);
+    assert(fiber_stack_peak(&deep) < 32 * 1024);
+    assert(fiber_stack_peak(&shallow) < fiber_stack_peak(&deep));
+
+    /* shrink the stacks of one entry function, and of one thread */
+    assert(fiber_stack_hint(&small, 8192) == 0);
+    fiber_create(&thread, &small, NULL);
+    fiber_join(thread, NULL);
+    assert(fiber_stack_peak(&small) > 1024);
+    assert(fiber_stack_peak(&small) < 8192);
+
+    assert(fiber_attr_setstacksize(&attr, 64 * 1024) == 0);
+    fiber_create_attr(&thread, &attr, &deep, NULL);
+    fiber_join(thread, NULL);
+
+    fiber_destroy();
+
+    /* the statistics do not outlive the runtime */
+    assert(fiber_stack_peak(&deep) == 0);
+
+    printf("stack: OK\n");
+    return 0;
+}